@@ -6,7 +6,7 @@
 // mm_mult_serial.cpp
 // compilation:
 //   gnu compiler
-//      g++ prime.cpp -o prime -O3 -lm
+//      g++ prime.cpp -o prime -O3 -lm -pthread
 
 //#define TESTING
 using namespace std;
@@ -17,21 +17,23 @@ using namespace std;
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
-#include <sys/time.h>
+#include <time.h>
+#include <vector>
+#include "prime_driver.h"
+#include "prime_sieve.h"
+#include "prime_index.h"
+#include "prime_extend.h"
+#include "prime_test.h"
+#include "prime_memory.h"
+#include "prime_stats.h"
 
 
 
 #define MX_SZ 320
 #define SEED 2397           /* random number seed */
 #define MAX_VALUE  100.0    /* maximum size of array elements A, and B */
-
-/* copied from mpbench */
-#define TIMER_CLEAR     (tv1.tv_sec = tv1.tv_usec = tv2.tv_sec = tv2.tv_usec = 0)
-#define TIMER_START     gettimeofday(&tv1, (struct timezone*)0)
-//#define TIMER_ELAPSED   (tv2.tv_sec*1e6 + tv2.tv_usec) - (tv1.tv_sec*1e6 + tv1.tv_usec)
-#define TIMER_ELAPSED   ((tv2.tv_usec-tv1.tv_usec)+((tv2.tv_sec-tv1.tv_sec)*1000000))
-#define TIMER_STOP      gettimeofday(&tv2, (struct timezone*)0)
-struct timeval tv1,tv2;
+#define DEFAULT_SEGMENT_SIZE WHEEL_SEGMENT_BYTES /* segmented sieve window, sized to L1 */
+#define TEST_CHUNK 65536    /* numbers read from stdin per batch of --is-prime tests */
 
 /*
   This declaration facilitates the creation of a two dimensional 
@@ -50,21 +52,133 @@ struct timeval tv1,tv2;
 
 /*
   Routine to retrieve the highest number to search for all lower valued possibilites of prime numbers
+  Optional flags:
+    -s            use the cache-blocked segmented sieve
+    -k <KiB>      segment size in KiB for the segmented sieve (default 32, i.e. L1);
+                  each byte holds 30 numbers of the mod-30 wheel
+    --count       print the number of primes below highestNumber
+    --from <lo>   only sieve [lo, highestNumber); implies -s
+    --index <f>   answer from the persistent index f, sieving only what
+                  it does not cover yet; --count and --list query the
+                  range, --is-prime asks about highestNumber itself
+    --is-prime    without --index, test highestNumber, any 64-bit number,
+                  with trial division and Miller-Rabin (see prime_test.h);
+                  a highestNumber of - tests every number read from stdin
+    -t <threads>  threads for testing the numbers read from stdin
+    --stats       also count twin primes, prime triplets and quadruplets,
+                  sum the primes and list the maximal gaps, window by
+                  window in the same pass (see prime_stats.h); implies -s
+    --resume <f>  carry on the sieve state saved in f (created if missing)
+                  up to highestNumber and save it again, so a growing
+                  sequence of runs only sieves each number once
 */
-void get_max_number(int argc,char *argv[],int *highestNumber) {
-  if(argc!=2) {//if it is not two arguments (including the program name)
-    cout<<"usage:  prime <highestNumber"
+void get_max_number(int argc,char *argv[],uint64_t *highestNumber,
+		    bool *segmented,int *segmentSize,bool *countPrimes,
+		    uint64_t *lowestNumber,const char **indexPath,
+		    bool *isPrime,bool *listPrimes,bool *readStdin,int *threads,
+		    const char **resumePath,bool *stats) {
+  int arg=1;
+  *resumePath=0;
+  *stats=false;
+  *readStdin=false;
+  *threads=1;
+  *segmented=false;
+  *segmentSize=DEFAULT_SEGMENT_SIZE;
+  *countPrimes=false;
+  *lowestNumber=0;
+  *indexPath=0;
+  *isPrime=false;
+  *listPrimes=false;
+  while(arg<argc-1) {
+    if(strcmp(argv[arg],"-s")==0) {
+      *segmented=true;
+      arg++;
+    }
+    else if(strcmp(argv[arg],"--count")==0) {
+      *countPrimes=true;
+      arg++;
+    }
+    else if(strcmp(argv[arg],"--from")==0 && arg+1<argc-1) {
+      if (!PrimeParseNumber(argv[arg+1],lowestNumber)) break;
+      *segmented=true;
+      arg+=2;
+    }
+    else if(strcmp(argv[arg],"--index")==0 && arg+1<argc-1) {
+      *indexPath=argv[arg+1];
+      arg+=2;
+    }
+    else if(strcmp(argv[arg],"--resume")==0 && arg+1<argc-1) {
+      *resumePath=argv[arg+1];
+      arg+=2;
+    }
+    else if(strcmp(argv[arg],"--stats")==0) {
+      *stats=true;
+      *segmented=true;
+      arg++;
+    }
+    else if(strcmp(argv[arg],"--is-prime")==0) {
+      *isPrime=true;
+      arg++;
+    }
+    else if(strcmp(argv[arg],"--list")==0) {
+      *listPrimes=true;
+      arg++;
+    }
+    else if(strcmp(argv[arg],"-k")==0 && arg+1<argc-1) {
+      *segmentSize=atoi(argv[arg+1])*1024;
+      arg+=2;
+    }
+    else if(strcmp(argv[arg],"-t")==0 && arg+1<argc-1) {
+      *threads=atoi(argv[arg+1]);
+      arg+=2;
+    }
+    else break;
+  }
+  if(arg!=argc-1 || *threads<=0) {//the highest number must be the last argument
+    cout<<"usage:  prime [-s] [-k segmentKiB] [--count] [--stats] [--from lowestNumber]"
+	<<" [--index file [--is-prime] [--list]] <highestNumber>"
+	<< endl
+	<<"        prime [-k segmentKiB] [--count] --resume file <highestNumber>"
+	<< endl
+	<<"        prime --is-prime [-t threads] <number | ->"
 	<< endl;
     exit(1);
   }
-  else {
-    
-    *highestNumber = atoi(argv[1]);
-       
+  if (*isPrime && *indexPath==0) {
+    //no sieve is involved, so any 64-bit number will do
+    *readStdin=strcmp(argv[arg],"-")==0;
+    if (!*readStdin && !PrimeParseNumber(argv[arg],highestNumber)) {
+      cout<<"Error: not a 64-bit number: "<<argv[arg]
+	  << endl;
+      exit(1);
+    }
+    if (*countPrimes || *listPrimes || *segmented || *resumePath) {
+      cout<<"Error: --is-prime without --index only tests numbers"
+	  << endl;
+      exit(1);
+    }
+    return;
   }
+  if (!PrimeParseNumber(argv[arg],highestNumber)) *highestNumber=0;
   
-  if (*highestNumber<=2 ) {
-    cout<<"Error: highest number must be greater than 2"
+  if (*segmentSize<=0 || *segmentSize>(int)WHEEL_MAX_WINDOW) {
+    cout<<"Error: segment size must be between 1 and "<<WHEEL_MAX_WINDOW/1024<<" KiB"
+	<< endl;
+    exit(1);
+  }
+  PrimeCheckRange(*highestNumber,*lowestNumber,WHEEL_MAX_LIMIT);
+  if (*stats && (*indexPath || *resumePath)) {
+    cout<<"Error: --stats sieves the range itself and cannot be combined with --index or --resume"
+	<< endl;
+    exit(1);
+  }
+  if (*resumePath && (*indexPath || *lowestNumber)) {
+    cout<<"Error: --resume always counts from 0 and cannot be combined with --index or --from"
+	<< endl;
+    exit(1);
+  }
+  if (*listPrimes && *indexPath==0) {
+    cout<<"Error: --list needs --index"
 	<< endl;
     exit(1);
   }
@@ -100,6 +214,158 @@ void print_matrix(float *array,int dim_m,int dim_n)
   }
 }
 
+/*
+  Routine that sieves [lowestNumber, highestNumber) one window of segmentSize
+  wheel bytes (30 numbers each) at a time, so the cost follows the size of
+  the range rather than highestNumber.  The base primes up to
+  sqrt(highestNumber) are found once, then WheelSieveWindows initializes
+  and strikes out each window in a single reused buffer while it is
+  resident in cache, carrying every base prime's offsets from window to
+  window (and, from WHEEL_BUCKET_MIN_LIMIT on, queueing the large ones in
+  buckets).  The visitor below finishes each window while it is still in
+  cache: with countPrimes it is counted and the number of primes in the
+  range is returned, otherwise 0; with stats it is added to *stats.
+  Memory use is O(sqrt(N) + segmentSize).
+*/
+uint64_t segmented_sieve(uint64_t lowestNumber, uint64_t highestNumber, int segmentSize,
+			 bool countPrimes, PrimeStats *stats)
+{
+  uint64_t count=0;
+  vector<uint32_t> primes;
+  uint8_t *segment;
+  uint64_t rootHighestNumber=WheelSqrt(highestNumber);
+  uint64_t numBytes=WheelBytes(highestNumber);
+  uint64_t lowestByte=lowestNumber/WHEEL_SPAN;
+
+  //include the root itself so that squares of primes are struck out
+  WheelBasePrimes(rootHighestNumber+1,primes);
+
+  segment = new (nothrow) uint8_t[segmentSize];
+  if(segment==0) {
+    cout <<"ERROR:  Insufficient Memory" << endl;
+    exit(1);
+  }
+
+  WheelSieveWindows(segment,lowestByte,numBytes-lowestByte,highestNumber,primes,segmentSize,
+		    [&](uint8_t *window, uint64_t low, uint32_t bytes) {
+		      //the first window starts with the byte that holds lowestNumber
+		      if (low==lowestByte)
+			WheelClearBelow(window,low,bytes,lowestNumber);
+		      if (countPrimes)
+			count+=WheelCount(window,bytes);
+		      if (stats)
+			PrimeStatsAdd(*stats,window,low,bytes,lowestNumber,highestNumber);
+#ifdef PRINT_PRIMES
+		      WheelForEachPrime(window,low,bytes,highestNumber,
+					[&](uint64_t p) { if (p>=lowestNumber) cout<<p<<"\n"; });
+#endif
+		    },false);
+
+  delete [] segment;
+  if (!countPrimes) return 0;
+  return count+WheelUnstored(highestNumber)-WheelUnstored(lowestNumber);
+}
+
+/*
+  Routine that answers the queries from a persistent index, first
+  appending the blocks needed to cover highestNumber (and highestNumber
+  itself for --is-prime).  When the index already covers them nothing is
+  sieved: the file is mapped and the answers come from its count table
+  and one block of bits.
+*/
+void index_query(const char *indexPath, uint64_t lowestNumber, uint64_t highestNumber,
+		 bool countPrimes, bool isPrime, bool listPrimes)
+{
+  PrimeIndex index;
+  if (!PrimeIndexOpen(index,indexPath)) {
+    cout <<"ERROR:  Cannot open index " << indexPath << endl;
+    exit(1);
+  }
+  if (!PrimeIndexExtend(index,highestNumber+1)) {
+    cout <<"ERROR:  Cannot extend index " << indexPath << endl;
+    exit(1);
+  }
+  if (countPrimes)
+    cout << "primes=" << PrimeIndexCount(index,highestNumber)-PrimeIndexCount(index,lowestNumber) << endl;
+  if (isPrime)
+    cout << "isprime=" << PrimeIndexIsPrime(index,highestNumber) << endl;
+  if (listPrimes)
+    PrimeIndexForEach(index,lowestNumber,highestNumber,[](uint64_t p) { cout<<p<<"\n"; });
+  PrimeIndexClose(index);
+}
+
+/*
+  Routine that grows the sieve state saved in resumePath to highestNumber.
+  Only the wheel bytes past the saved end are sieved, with the offsets the
+  base primes had there, and the base primes are only extended past the
+  old square root.  The state is saved again before the count is taken
+  from it, so the next run picks up from here.  A highestNumber below the
+  last saved byte cannot be answered from the state and is an error.
+*/
+uint64_t resume_sieve(const char *resumePath, uint64_t highestNumber, int segmentSize)
+{
+  PrimeExtendState state;
+  uint64_t count;
+  if (!PrimeExtendLoad(state,resumePath)) {
+    cout <<"ERROR:  Not a sieve state: " << resumePath << endl;
+    exit(1);
+  }
+#ifdef PRINT_PRIMES
+  //only the primes no earlier run has reached are printed
+  uint64_t printFrom=state.limit;
+#endif
+  PrimeExtendTo(state,highestNumber,segmentSize,
+#ifdef PRINT_PRIMES
+		[&](const uint8_t *segment, uint64_t low, uint32_t bytes) {
+		  WheelForEachPrime(segment,low,bytes,highestNumber,[&](uint64_t p) {
+		      if (p>=printFrom && p<highestNumber) cout<<p<<"\n";
+		    });
+		});
+#else
+		[](const uint8_t *, uint64_t, uint32_t) {});
+#endif
+  if (!PrimeExtendCount(state,highestNumber,&count)) {
+    cout <<"ERROR:  " << resumePath << " already covers up to "
+	 << PrimeExtendLimit(state) << "; use --index to query below that" << endl;
+    exit(1);
+  }
+  if (!PrimeExtendSave(state,resumePath)) {
+    cout <<"ERROR:  Cannot save sieve state " << resumePath << endl;
+    exit(1);
+  }
+  return count;
+}
+
+/*
+  Routine that tests every number read from stdin, TEST_CHUNK at a time
+  spread over the threads, and prints each one followed by 1 if it is
+  prime and 0 if not.
+*/
+void test_numbers(int threads)
+{
+  ThreadPool pool(threads);
+  vector<uint64_t> values;
+  vector<uint8_t> results;
+  string word;
+  bool more=true;
+  while (more) {
+    values.clear();
+    while (values.size()<TEST_CHUNK && (more=(bool)(cin>>word))) {
+      uint64_t value;
+      if (!PrimeParseNumber(word.c_str(),&value)) {
+	cout<<"Error: not a 64-bit number: "<<word<<endl;
+	exit(1);
+      }
+      values.push_back(value);
+    }
+    if (values.empty()) break;
+    results.resize(values.size());
+    PrimeTestBatch(&values[0],&results[0],values.size(),pool);
+    for (size_t i=0; i<values.size(); i++)
+      cout<<values[i]<<" "<<(int)results[i]<<"\n";
+  }
+}
+
 /*
   MAIN ROUTINE: summation of a number list
 */
@@ -107,30 +373,88 @@ void print_matrix(float *array,int dim_m,int dim_n)
 int main( int argc, char *argv[])
 {
 
-  int highestNumber;
-  int rootHighestNumber;
+  uint64_t highestNumber;
+  uint64_t rootHighestNumber;
   int *numberArray;
-  bool *isPrimeArray;
+  uint8_t *isPrimeArray;
+  uint64_t numBytes;
+  bool segmented;
+  int segmentSize;
+  bool countPrimes;
+  uint64_t numPrimes=0;
+  uint64_t lowestNumber;
+  const char *indexPath;
+  bool isPrime;
+  bool listPrimes;
+  bool readStdin;
+  int threads;
+  const char *resumePath;
+  PrimeMemory memory;
+  bool stats;
+  PrimeStats primeStats;
 
   /* 
      get matrix sizes
   */
-  get_max_number(argc,argv,&highestNumber);
+  get_max_number(argc,argv,&highestNumber,&segmented,&segmentSize,&countPrimes,&lowestNumber,
+		 &indexPath,&isPrime,&listPrimes,&readStdin,&threads,&resumePath,&stats);
+
+  //single numbers are tested directly, without sieving up to them
+  if (isPrime && !indexPath) {
+    TIMER_CLEAR;
+    TIMER_START;
+    if (readStdin) test_numbers(threads);
+    else cout << "isprime=" << PrimeTestIsPrime(highestNumber) << endl;
+    TIMER_STOP;
+    cout << "time=" << setprecision(8) <<  TIMER_ELAPSED/1000000.0  << " seconds" << endl;
+    return 0;
+  }
   //determine square root
-  rootHighestNumber=sqrt(highestNumber);
+  rootHighestNumber=WheelSqrt(highestNumber);
 
+  if (indexPath) {
+    TIMER_CLEAR;
+    TIMER_START;
+    index_query(indexPath,lowestNumber,highestNumber,countPrimes,isPrime,listPrimes);
+    TIMER_STOP;
+    cout << "time=" << setprecision(8) <<  TIMER_ELAPSED/1000000.0  << " seconds" << endl;
+    return 0;
+  }
 
+  if (resumePath) {
+    TIMER_CLEAR;
+    TIMER_START;
+    numPrimes=resume_sieve(resumePath,highestNumber,segmentSize);
+    TIMER_STOP;
+    if (countPrimes) cout << "primes=" << numPrimes << endl;
+    cout << "time=" << setprecision(8) <<  TIMER_ELAPSED/1000000.0  << " seconds" << endl;
+    return 0;
+  }
+
+  if (segmented) {
+    TIMER_CLEAR;
+    TIMER_START;
+    numPrimes=segmented_sieve(lowestNumber,highestNumber,segmentSize,countPrimes,
+			      stats ? &primeStats : 0);
+    TIMER_STOP;
+    if (countPrimes) cout << "primes=" << numPrimes << endl;
+    if (stats) PrimeStatsPrint(primeStats,cout);
+    cout << "time=" << setprecision(8) <<  TIMER_ELAPSED/1000000.0  << " seconds" << endl;
+    return 0;
+  }
 
-  // dynamically allocate 
-  isPrimeArray = new (nothrow) bool[highestNumber];
+
+  // dynamically allocate, in huge pages where possible
+  numBytes=WheelBytes(highestNumber);
+  isPrimeArray = PrimeMemoryAlloc(memory,numBytes) ? memory.data : 0;
   // test for correct allocation
   if(isPrimeArray==0) {
     cout <<"ERROR:  Insufficient Memory" << endl;
     exit(1);
   }
-  //initialize isPrimeArray to true, all non-primes
-  //will be marked false.
-  for ( int i=0;i<highestNumber;i++) isPrimeArray[i]=true;
+  //initialize isPrimeArray to all candidates, all non-primes
+  //will be cleared.
+  WheelInit(isPrimeArray,0,numBytes,highestNumber);
 
   /*
     Start recording the execution time
@@ -145,29 +469,40 @@ int main( int argc, char *argv[])
   //At each number, if the number has not been marks as
   //non-prime in the previous iterations, it is prime.
 
-  for ( int i=2; i<rootHighestNumber; i++){
+  //Multiples of 2, 3 and 5 are never stored and WheelInit
+  //already struck out the primes up to WHEEL_PRESIEVE_MAX.
+  for ( uint32_t i=WHEEL_PRESIEVE_MAX+1; i<=rootHighestNumber; i++){
     //check to see if the current number is a prime. 
-    if (isPrimeArray[i]==true){
+    if (WheelTest(isPrimeArray,0,i)){
       //mark all multiples as non-primes
-      for (int j=i*2 ; j<=highestNumber ; j=j+i){
-	isPrimeArray[j]=false;
-      }
+      WheelMark(isPrimeArray,0,numBytes,i);
     }
 
   }
-    TIMER_STOP;  
+  //count the survivors straight from the packed array
+  if (countPrimes)
+    numPrimes=WheelCount(isPrimeArray,numBytes)+WheelUnstored(highestNumber);
+  TIMER_STOP;
 
-  //print primes
-    //  for ( int i=1;i<highestNumber;i++) 
-    // if (isPrimeArray[i]==true)cout<<i<<endl;
+#ifdef PRINT_PRIMES
+  WheelForEachPrime(isPrimeArray,0,numBytes,highestNumber,[](uint64_t p) { cout<<p<<"\n"; });
+#endif
 
  
   /*
     stop recording the execution time
   */ 
 
- 
+  if (countPrimes) cout << "primes=" << numPrimes << endl;
   cout << "time=" << setprecision(8) <<  TIMER_ELAPSED/1000000.0  << " seconds" << endl;
+  //PRIME_TRACE, as in the parallel versions, also tells where the array lies
+  const char *trace=getenv("PRIME_TRACE");
+  if (trace && *trace && strcmp(trace,"0")!=0) {
+    char placement[64];
+    PrimeMemoryPlacement(memory,placement,sizeof(placement));
+    cout << "memory=" << placement << endl;
+  }
+  PrimeMemoryFree(memory);
 }
 
 
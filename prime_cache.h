@@ -0,0 +1,338 @@
+//MIT License
+
+//Copyright (c) 2016 Ashton Johnson
+
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+
+/******************************************************************/
+/**
+* In-memory cache of sieved segments
+* @file prime_cache.h
+* @author Ashton Johnson, Paul Henny
+* @brief Answers pi(x), next prime, n-th prime and prime ranges from
+* sieved segments kept in memory, sieving only what is missing.
+*
+* The numbers are cut into segments of PRIME_CACHE_SEGMENT wheel bytes.
+* The bitmaps of the most recently used segments are kept, up to a fixed
+* number, and the least recently used one is dropped to make room.
+* Besides them the cache holds two things that are never dropped.  One is
+* a count checkpoint per segment: the number of primes below it, known
+* for every segment from 0 up to the highest one counted so far.  It
+* costs 8 bytes per 3.9 million numbers.  The other is the base primes,
+* up to the square root of the highest segment sieved.
+*
+* A query on a cached segment costs a table lookup and a popcount of at
+* most one segment.  Missing segments are sieved all at once on the
+* threads of a ThreadPool.  When there are fewer of them than threads,
+* each one is split into slices, as the drivers split their blocks.
+*
+* Not thread safe: one thread queries, the pool only sieves.
+*/
+#ifndef PRIME_CACHE_H
+#define PRIME_CACHE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include "prime_sieve.h"
+#include "prime_threads.h"
+
+/// Wheel bytes per segment, about 3.9 million numbers.
+#define PRIME_CACHE_SEGMENT (1u << 17)
+
+/// Segments counted per parallel round while checkpoints are extended.
+#define PRIME_CACHE_ROUND 64
+
+/// A cached segment.
+struct PrimeCacheEntry {
+  uint64_t segment;
+  std::vector<uint8_t> bits;
+};
+
+/** \brief Sieved segments, count checkpoints and base primes. */
+struct PrimeCache {
+  /// cached segments, most recently used first
+  std::list<PrimeCacheEntry> lru;
+  std::unordered_map<uint64_t, std::list<PrimeCacheEntry>::iterator> where;
+  /// most segments kept
+  size_t capacity;
+  /// before[s] is the number of primes below segment s, 2, 3 and 5
+  /// included; segments below before.size() - 1 are counted
+  std::vector<uint64_t> before;
+  /// base primes below baseLimit
+  std::vector<uint32_t> base;
+  uint64_t baseLimit;
+  /// numbers from here on are not served
+  uint64_t maxNumber;
+  ThreadPool *pool;
+  /// segment lookups that found the segment, and segments sieved
+  uint64_t hits, sieved;
+
+  PrimeCache() : capacity(0), baseLimit(0), maxNumber(0), pool(0), hits(0), sieved(0) {}
+};
+
+/** \brief Sets up an empty cache.
+ * \param capacity segments kept, at least 2
+ * \param maxNumber queries must stay below this, at most WHEEL_MAX_LIMIT
+ */
+static inline void PrimeCacheInit(PrimeCache &c, size_t capacity, uint64_t maxNumber,
+                                  ThreadPool *pool)
+{
+  c.lru.clear();
+  c.where.clear();
+  c.capacity = capacity < 2 ? 2 : capacity;
+  c.before.assign(1, 0);
+  c.base.clear();
+  c.baseLimit = 0;
+  c.maxNumber = maxNumber < WHEEL_MAX_LIMIT ? maxNumber : WHEEL_MAX_LIMIT;
+  c.pool = pool;
+  c.hits = c.sieved = 0;
+}
+
+/** \brief Segment that holds n. */
+static inline uint64_t PrimeCacheSegmentOf(uint64_t n)
+{
+  return n / WHEEL_SPAN / PRIME_CACHE_SEGMENT;
+}
+
+/** \brief Numbers below the end of segment s. */
+static inline uint64_t PrimeCacheEnd(uint64_t s)
+{
+  return (s + 1) * PRIME_CACHE_SEGMENT * WHEEL_SPAN;
+}
+
+/** \brief Grows the base primes to cover every number below end.
+ *
+ * The limit at least doubles each time, so the table is rebuilt only a
+ * few times over the life of the cache.
+ */
+static inline void PrimeCacheBase(PrimeCache &c, uint64_t end)
+{
+  uint64_t needed = WheelSqrt(end) + 1;
+  if (needed <= c.baseLimit) return;
+  uint64_t limit = std::max(needed, 2 * c.baseLimit);
+  if (limit > UINT32_MAX) limit = UINT32_MAX;
+  c.base.clear();
+  WheelBasePrimes((uint32_t)limit, c.base);
+  c.baseLimit = limit;
+}
+
+/** \brief Cached bitmap of segment s, or null; a hit becomes the most
+ * recently used.
+ */
+static inline const uint8_t *PrimeCacheFind(PrimeCache &c, uint64_t s)
+{
+  std::unordered_map<uint64_t, std::list<PrimeCacheEntry>::iterator>::iterator it = c.where.find(s);
+  if (it == c.where.end()) return 0;
+  c.lru.splice(c.lru.begin(), c.lru, it->second);
+  c.hits++;
+  return &it->second->bits[0];
+}
+
+/** \brief Sieves every segment of the list that is not cached, in
+ * parallel, and caches it.
+ * \param counts if not null, receives the primes in each segment of the
+ * list, in the list's order; 2, 3 and 5 are not included
+ *
+ * The list must fit the cache.  Segments already cached are only counted.
+ */
+static inline void PrimeCacheSieve(PrimeCache &c, const std::vector<uint64_t> &segments,
+                                   std::vector<uint64_t> *counts)
+{
+  if (counts) counts->assign(segments.size(), 0);
+  std::vector<size_t> missing;
+  for (size_t i = 0; i < segments.size(); i++) {
+    // cached ones become the most recent, so the new ones do not evict them
+    if (PrimeCacheFind(c, segments[i])) continue;
+    bool repeated = false;
+    for (size_t j = 0; j < missing.size() && !repeated; j++)
+      repeated = segments[missing[j]] == segments[i];
+    if (!repeated) missing.push_back(i);
+  }
+  if (!missing.empty()) {
+    uint64_t end = 0;
+    for (size_t j = 0; j < missing.size(); j++)
+      end = std::max(end, PrimeCacheEnd(segments[missing[j]]));
+    PrimeCacheBase(c, end);
+    // every missing segment is split into slices so all threads have work
+    int threads = c.pool->Size();
+    int slices = std::max(1, threads / (int)missing.size());
+    size_t items = missing.size() * slices;
+    std::vector<std::vector<uint8_t> > bits(missing.size());
+    for (size_t j = 0; j < missing.size(); j++) bits[j].resize(PRIME_CACHE_SEGMENT);
+    c.pool->Run([&](int t) {
+      for (size_t item = t; item < items; item += threads) {
+        size_t j = item / slices;
+        uint64_t low, n;
+        ThreadSlice(PRIME_CACHE_SEGMENT, slices, (int)(item % slices), &low, &n);
+        if (n == 0) continue;
+        uint64_t s = segments[missing[j]];
+        WheelSieveBlock(&bits[j][low], s * PRIME_CACHE_SEGMENT + low, n, PrimeCacheEnd(s),
+                        c.base, WHEEL_SEGMENT_BYTES);
+      }
+    });
+    for (size_t j = 0; j < missing.size(); j++) {
+      if (c.lru.size() >= c.capacity) {
+        c.where.erase(c.lru.back().segment);
+        c.lru.pop_back();
+      }
+      c.lru.push_front(PrimeCacheEntry());
+      c.lru.front().segment = segments[missing[j]];
+      c.lru.front().bits.swap(bits[j]);
+      c.where[segments[missing[j]]] = c.lru.begin();
+    }
+    c.sieved += missing.size();
+  }
+  if (counts)
+    for (size_t i = 0; i < segments.size(); i++)
+      (*counts)[i] = WheelCount(&c.where[segments[i]]->bits[0], PRIME_CACHE_SEGMENT);
+}
+
+/** \brief Bitmap of segment s, sieved if it is not cached.
+ *
+ * Valid until the next segment is sieved into the cache.
+ */
+static inline const uint8_t *PrimeCacheGet(PrimeCache &c, uint64_t s)
+{
+  const uint8_t *bits = PrimeCacheFind(c, s);
+  if (bits) return bits;
+  PrimeCacheSieve(c, std::vector<uint64_t>(1, s), 0);
+  return &c.where[s]->bits[0];
+}
+
+/** \brief Extends the checkpoints to segment s, PRIME_CACHE_ROUND
+ * segments at a time, or as many as the cache holds.
+ */
+static inline void PrimeCacheCountTo(PrimeCache &c, uint64_t s)
+{
+  size_t round = std::min((size_t)PRIME_CACHE_ROUND, c.capacity);
+  while (c.before.size() <= s) {
+    uint64_t first = c.before.size() - 1;
+    uint64_t n = std::min((uint64_t)round, s + 1 - first);
+    std::vector<uint64_t> segments(n), counts;
+    for (uint64_t k = 0; k < n; k++) segments[k] = first + k;
+    PrimeCacheSieve(c, segments, &counts);
+    for (uint64_t k = 0; k < n; k++)
+      c.before.push_back(c.before.back() + counts[k] + (first + k == 0 ? 3 : 0));
+  }
+}
+
+/** \brief pi(x): the number of primes up to and including x, for x below
+ * maxNumber.
+ */
+static inline uint64_t PrimeCachePi(PrimeCache &c, uint64_t x)
+{
+  uint64_t y = x + 1;
+  uint64_t byte = y / WHEEL_SPAN;
+  uint64_t s = byte / PRIME_CACHE_SEGMENT;
+  PrimeCacheCountTo(c, s);
+  const uint8_t *bits = PrimeCacheGet(c, s);
+  uint64_t k = byte - s * PRIME_CACHE_SEGMENT;
+  uint64_t count = c.before[s] + WheelCount(bits, k);
+  // 2, 3 and 5 are in the count of the whole first segment
+  if (s == 0) count += WheelUnstored(y);
+  for (int i = 0; i < 8; i++)
+    if (byte * WHEEL_SPAN + WHEEL_OFFSET[i] < y) count += bits[k] >> i & 1;
+  return count;
+}
+
+/** \brief Smallest prime above x.
+ * \return false if there is none below maxNumber
+ */
+static inline bool PrimeCacheNext(PrimeCache &c, uint64_t x, uint64_t *prime)
+{
+  static const uint64_t SMALL[3] = {2, 3, 5};
+  for (int i = 0; i < 3; i++)
+    if (x < SMALL[i]) { *prime = SMALL[i]; return true; }
+  for (uint64_t s = PrimeCacheSegmentOf(x + 1); s * PRIME_CACHE_SEGMENT * WHEEL_SPAN < c.maxNumber;
+       s++) {
+    const uint8_t *bits = PrimeCacheGet(c, s);
+    uint64_t segmentLow = s * PRIME_CACHE_SEGMENT;
+    uint64_t k = (x + 1) / WHEEL_SPAN > segmentLow ? (x + 1) / WHEEL_SPAN - segmentLow : 0;
+    for (; k < PRIME_CACHE_SEGMENT; k++)
+      for (uint8_t b = bits[k]; b; b &= b - 1) {
+        uint64_t p = (segmentLow + k) * WHEEL_SPAN + WHEEL_OFFSET[__builtin_ctz(b)];
+        if (p <= x) continue;
+        if (p >= c.maxNumber) return false;
+        *prime = p;
+        return true;
+      }
+  }
+  return false;
+}
+
+/** \brief The n-th prime, counting 2 as the first.
+ * \return false if n is 0 or the prime is not below maxNumber
+ */
+static inline bool PrimeCacheNth(PrimeCache &c, uint64_t n, uint64_t *prime)
+{
+  static const uint64_t SMALL[3] = {2, 3, 5};
+  if (n == 0) return false;
+  if (n <= 3) { *prime = SMALL[n - 1]; return true; }
+  // count on until some checkpoint reaches n
+  while (c.before.back() < n) {
+    uint64_t next = c.before.size() - 1;
+    if (next * PRIME_CACHE_SEGMENT * WHEEL_SPAN >= c.maxNumber) return false;
+    PrimeCacheCountTo(c, next + std::min((size_t)PRIME_CACHE_ROUND, c.capacity) - 1);
+  }
+  // the segment whose checkpoint is the last one below n
+  uint64_t s = std::lower_bound(c.before.begin(), c.before.end(), n) - c.before.begin() - 1;
+  uint64_t left = n - c.before[s] - (s == 0 ? 3 : 0);
+  const uint8_t *bits = PrimeCacheGet(c, s);
+  uint64_t k = 0;
+  for (; k < PRIME_CACHE_SEGMENT; k++) {
+    uint64_t inByte = __builtin_popcount(bits[k]);
+    if (left <= inByte) break;
+    left -= inByte;
+  }
+  uint8_t b = bits[k];
+  while (--left > 0) b &= b - 1;
+  *prime = (s * PRIME_CACHE_SEGMENT + k) * WHEEL_SPAN + WHEEL_OFFSET[__builtin_ctz(b)];
+  return *prime < c.maxNumber;
+}
+
+/** \brief Calls visit(p) for every prime in [lo, hi], in order, until it
+ * returns false; hi must be below maxNumber.
+ *
+ * The segments of the range are sieved a cache-full at a time, all the
+ * missing ones of a round in parallel.
+ */
+template <typename Visitor>
+static inline void PrimeCacheRange(PrimeCache &c, uint64_t lo, uint64_t hi, Visitor visit)
+{
+  if (lo > hi) return;
+  uint64_t first = PrimeCacheSegmentOf(lo), last = PrimeCacheSegmentOf(hi);
+  bool more = true;
+  for (uint64_t s = first; s <= last && more; s += c.capacity) {
+    uint64_t n = std::min((uint64_t)c.capacity, last + 1 - s);
+    std::vector<uint64_t> segments(n);
+    for (uint64_t k = 0; k < n; k++) segments[k] = s + k;
+    PrimeCacheSieve(c, segments, 0);
+    for (uint64_t k = 0; k < n && more; k++)
+      WheelForEachPrime(PrimeCacheGet(c, s + k), (s + k) * PRIME_CACHE_SEGMENT,
+                        PRIME_CACHE_SEGMENT, hi + 1, [&](uint64_t p) {
+                          if (more && p >= lo && p <= hi) more = visit(p);
+                        });
+  }
+}
+
+#endif /* PRIME_CACHE_H */
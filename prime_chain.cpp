@@ -11,13 +11,45 @@
 //   prime_chain.cpp
 //   then execute the following command
 //      gnu compiler
-//         mpic++ prime_chain.cpp -o prime_chain -lm  -O3
+//         mpic++ prime_chain.cpp -o prime_chain -lm  -O3 -pthread
 /*
   Daisy-chain data passing model.  The prime to check the data sample
   is passed to each process after the previous finishes.
 
   To execute:
-  prime_chain max_numb
+  prime_chain [-p] [-b batch] [-o count|bits|delta|stats|none] [-t threads]
+              [-s] [-w file [-f raw|delta|text]] max_numb
+
+  -p streams the primes down the chain in batches of (prime, next
+     multiple) pairs with non-blocking sends, so every process marks
+     one batch while the next one is on its way (default batch CHAIN_BATCH).
+  -o selects what rank 0 collects: the number of primes up to and
+     including max_numb (default, MPI_Reduce), the wheel bits or the
+     varint gaps between primes, the prime statistics of prime_stats.h
+     (a custom MPI_Reduce in rank order), or nothing at all.  Bits and gaps are streamed: every STREAM_BYTES
+     piece of a block is sent with MPI_Isend as soon as the seed primes
+     that reach it have passed, while the chain is still running.
+     Compiled with -DPRINT_PRIMES, rank 0 prints the primes it collected
+     as bits or gaps, one per line.
+  -w writes the primes to a file instead of gathering them: every process
+     writes its own block with collective MPI-IO (see prime_io.h) in raw
+     (default), delta or text form, as chosen by -f.
+
+  -t runs that many threads in every process, each marking its own slice
+     of the block; only the main thread calls MPI (MPI_THREAD_FUNNELED).
+  -s allocates every block as one process's part of an MPI shared memory
+     window per node (see prime_node.h).  With -o bits or delta, rank 0
+     then reads the blocks of its own node in place, and only the blocks
+     of other nodes travel as messages.
+
+  Every process initializes its own block, so rank 0 only holds the
+  whole range when the bits are collected.
+
+  PRIME_TRACE=1 in the environment prints how long each process spent in
+  every stage (see prime_trace.h); PRIME_TRACE=file writes it as CSV.
+  It also shows how each block is paged and on which NUMA nodes it lies:
+  blocks are mapped in huge pages where possible (see prime_memory.h) and
+  every thread initializes the slice it marks, so its pages are local.
 */
 
 //#define TESTING
@@ -30,39 +62,489 @@ using namespace std;
 #include <string.h>
 #include <math.h>
 #include <mpi.h> // for MPI parrallelism
-#include <sys/time.h>
+#include <time.h>
+#include <vector>
+#include "prime_driver.h"
+#include "prime_sieve.h"
+#include "prime_threads.h"
+#include "prime_io.h"
+#include "prime_trace.h"
+#include "prime_memory.h"
+#include "prime_stats.h"
+#include "prime_node.h"
 
 #define MX_SZ 320
 #define SEED 2397           /* random number seed */
 #define MAX_VALUE  100.0    /* maximum size of array elements A, and B */
+#define BLOCK_ALIGN 64      /* blocks are whole cache lines, as the thread slices are */
+#define CHAIN_BATCH 512     /* default (prime, next multiple) pairs per pipelined message */
+#define STREAM_BYTES (1u<<20) /* wheel bytes per piece streamed to rank 0, whole chunks */
+#define STREAM_TAG 100      /* tag of the streamed pieces, below the chain's tags */
 
-/* copied from mpbench */
-#define TIMER_CLEAR     (tv1.tv_sec = tv1.tv_usec = tv2.tv_sec = tv2.tv_usec = 0)
-#define TIMER_START     gettimeofday(&tv1, (struct timezone*)0)
-//#define TIMER_ELAPSED   (tv2.tv_sec*1e6 + tv2.tv_usec) - (tv1.tv_sec*1e6 + tv1.tv_usec)
-#define TIMER_ELAPSED   ((tv2.tv_usec-tv1.tv_usec)+((tv2.tv_sec-tv1.tv_sec)*1000000))
-#define TIMER_STOP      gettimeofday(&tv2, (struct timezone*)0)
-struct timeval tv1,tv2;
+/* results collected by rank 0, selected with -o */
+enum output_mode { OUTPUT_NONE, OUTPUT_COUNT, OUTPUT_BITS, OUTPUT_DELTA, OUTPUT_STATS };
 
 /*
   Routine to retrieve the highest number to search for all lower valued possibilites of prime numbers
+  Optional flags:
+    -p            pipeline batches of primes down the chain
+    -b <pairs>    (prime, next multiple) pairs per pipelined message
+    -o <output>   count, bits, delta, stats or none
+    --count       same as -o count, the default
+    -t <threads>  marking threads per process
+    -s            blocks in memory shared by the processes of a node
+    -w <file>     write the primes to file with MPI-IO
+    -f <format>   raw, delta or text for -w
 */
-void get_max_number(int argc,char *argv[],int *highestNumber) {
-  if(argc!=2) {//if it is not two arguments (including the program name)
-    cout<<"usage:  prime <highestNumber>"
+void get_max_number(int argc,char *argv[],uint64_t *highestNumber,
+                    bool *pipelined,int *batchSize,output_mode *output,int *threads,
+                    bool *shared,const char **write_path,PrimeFileFormat *write_format) {
+  int arg=1;
+  *pipelined=false;
+  *batchSize=CHAIN_BATCH;
+  *output=OUTPUT_COUNT;
+  *threads=1;
+  *shared=false;
+  *write_path=0;
+  *write_format=PRIME_FILE_RAW;
+  while(arg<argc-1) {
+    if(strcmp(argv[arg],"-p")==0) {
+      *pipelined=true;
+      arg++;
+    }
+    else if(strcmp(argv[arg],"-b")==0 && arg+1<argc-1) {
+      *batchSize=atoi(argv[arg+1]);
+      arg+=2;
+    }
+    else if(strcmp(argv[arg],"-t")==0 && arg+1<argc-1) {
+      *threads=atoi(argv[arg+1]);
+      arg+=2;
+    }
+    else if(strcmp(argv[arg],"-s")==0) {
+      *shared=true;
+      arg++;
+    }
+    else if(strcmp(argv[arg],"-w")==0 && arg+1<argc-1) {
+      *write_path=argv[arg+1];
+      arg+=2;
+    }
+    else if(strcmp(argv[arg],"-f")==0 && arg+1<argc-1) {
+      if(!PrimeFileParseFormat(argv[arg+1],write_format)) break;
+      arg+=2;
+    }
+    else if(strcmp(argv[arg],"--count")==0) {
+      *output=OUTPUT_COUNT;
+      arg++;
+    }
+    else if(strcmp(argv[arg],"-o")==0 && arg+1<argc-1) {
+      if(strcmp(argv[arg+1],"count")==0) *output=OUTPUT_COUNT;
+      else if(strcmp(argv[arg+1],"bits")==0) *output=OUTPUT_BITS;
+      else if(strcmp(argv[arg+1],"delta")==0) *output=OUTPUT_DELTA;
+      else if(strcmp(argv[arg+1],"stats")==0) *output=OUTPUT_STATS;
+      else if(strcmp(argv[arg+1],"none")==0) *output=OUTPUT_NONE;
+      else break;
+      arg+=2;
+    }
+    else break;
+  }
+  if(arg!=argc-1 || *batchSize<=0 || *threads<=0) {//the highest number must be the last argument
+    cout<<"usage:  prime_chain [-p] [-b batch] [-o count|bits|delta|stats|none] [--count] [-t threads] [-s]"
+        <<" [-w file [-f raw|delta|text]] <highestNumber>"
 	<< endl;
     exit(1);
   }
-  else {
+  else if (!PrimeParseNumber(argv[arg],highestNumber)) *highestNumber=0;
+
+  // numbers up to and including highestNumber are sieved
+  PrimeCheckRange(*highestNumber,0,WHEEL_MAX_LIMIT-1);
+}
+
+/*
+  Routine that initializes this process's block to all candidates.  Each
+  thread of the pool writes the slice mark_primes gives it, which places
+  those pages on its NUMA node.
+*/
+void init_block(ThreadPool *pool,uint8_t *prime_buf,uint64_t block_low,uint64_t num_to_send,
+                uint64_t limit)
+{
+  pool->Run([&](int t) {
+    uint64_t low, n;
+    ThreadSlice(num_to_send,pool->Size(),t,&low,&n);
+    WheelInit(prime_buf+low,block_low+low,n,limit);
+  });
+}
+
+/*
+  Routine that strikes count primes, stride words apart, out of this
+  process's block.  firsts, if given, holds the first multiple of each
+  prime still to strike, stride words apart as well; otherwise each
+  prime starts at its square.  Each thread of the pool takes its own
+  slice.
+*/
+void mark_primes(ThreadPool *pool,uint8_t *prime_buf,uint64_t block_low,uint64_t num_to_send,
+                 const uint64_t *primes,const uint64_t *firsts,int stride,int count)
+{
+  PrimeTraceBegin();
+  pool->Run([&](int t) {
+    uint64_t low, n;
+    ThreadSlice(num_to_send,pool->Size(),t,&low,&n);
+    for (int k=0; k<count; k++)
+      WheelMark(prime_buf+low,block_low+low,n,(uint32_t)primes[k*stride],
+                firsts ? firsts[k*stride] : 0);
+  });
+  PrimeTraceEnd(TRACE_MARK);
+}
+
+/*
+  Routine that returns the first multiple of prime from end on, given
+  multiple, the first one not yet struck.
+*/
+uint64_t next_multiple(uint64_t multiple,uint64_t prime,uint64_t end)
+{
+  return multiple>=end ? multiple : multiple+(end-multiple+prime-1)/prime*prime;
+}
 
-    *highestNumber = atoi(argv[1]);
+/*
+  A process's block on its way to rank 0 with -o bits or delta.  The
+  block is cut into pieces of STREAM_BYTES wheel bytes, up to the byte
+  that holds highestNumber.  Seed primes come down the chain in
+  increasing order, and a prime p only strikes multiples from p*p on.
+  So once every prime up to p has been marked, the numbers below (p+1)^2
+  are final and are never written again.  Each piece that is final is
+  sent with MPI_Isend straight away, in bits straight from the block,
+  while the chain goes on.  Rank 0 posts the receives for the bits up
+  front, directly into the result, and probes for the gap lists, whose
+  length is unknown.  Pieces of one process arrive in order.
+  With -s the blocks are parts of a node-wide shared window, and the
+  processes on rank 0's node send nothing: rank 0 reads their blocks in
+  place once the chain is over.
+*/
+struct chain_stream {
+  output_mode output;
+  int rank, numtasks;
+  uint64_t num_to_send;
+  // numbers up to highestNumber, i.e. below limit, are collected
+  uint64_t limit;
+  // first wheel byte of this process's block, and how much of it is sent
+  uint64_t block_low, bytes;
+  // next piece to send and the sends under way
+  uint64_t next;
+  vector<MPI_Request> requests;
+  // the gap list of every piece sent, kept until the sends complete
+  vector<vector<uint8_t> > deltas;
+  // rank 0: the collected bits and the receives posted into them
+  uint8_t *result;
+  vector<MPI_Request> receives;
+  // with -s: this node and its window of blocks, and the processes
+  // whose block rank 0 reads in place; as far as this process knows
+  const PrimeNode *node;
+  const PrimeNodeWindow *window;
+  vector<bool> nearby;
+};
+
+/*
+  Routine that returns how many wheel bytes of a block are collected:
+  those that hold numbers up to highestNumber.
+*/
+uint64_t stream_bytes(uint64_t block_low,uint64_t num_to_send,uint64_t limit)
+{
+  uint64_t needed = WheelBytes(limit);
+  return needed>block_low ? min(num_to_send,needed-block_low) : 0;
+}
 
+/*
+  Routine that sets a stream up before the chain starts; on rank 0 with
+  -o bits it also posts a receive for every piece of every other process.
+*/
+void stream_open(chain_stream &stream,int rank,int numtasks,uint64_t num_to_send,
+                 uint64_t highestNumber,output_mode output,const PrimeNode *node,
+                 const PrimeNodeWindow *window)
+{
+  stream.output = output;
+  stream.rank = rank;
+  stream.numtasks = numtasks;
+  stream.num_to_send = num_to_send;
+  stream.limit = highestNumber+1;
+  stream.block_low = num_to_send*rank;
+  stream.bytes = stream_bytes(stream.block_low,num_to_send,stream.limit);
+  stream.next = 0;
+  stream.result = 0;
+  stream.node = node;
+  stream.window = window;
+  stream.nearby.assign(numtasks,false);
+  // world rank 0 is the lowest rank of its node, so its node rank 0
+  if (node && node->worldRanks[0]==0)
+    for (int k=0; k<node->size; k++) stream.nearby[node->worldRanks[k]] = true;
+  if (rank!=0 && stream.nearby[rank]) stream.bytes = 0;
+  if (rank!=0 || output!=OUTPUT_BITS) return;
+  stream.result = new (nothrow) uint8_t[WheelBytes(stream.limit)+1];
+  if (stream.result==0) {
+    cout <<"ERROR:  Insufficient Memory" << endl;
+    MPI_Abort(MPI_COMM_WORLD,1);
   }
+  for (int r=1; r<numtasks; r++) {
+    uint64_t low = num_to_send*r;
+    uint64_t bytes = stream.nearby[r] ? 0 : stream_bytes(low,num_to_send,stream.limit);
+    for (uint64_t piece=0; piece<bytes; piece+=STREAM_BYTES) {
+      stream.receives.push_back(MPI_REQUEST_NULL);
+      MPI_Irecv(stream.result+low+piece,(int)min((uint64_t)STREAM_BYTES,bytes-piece),MPI_BYTE,
+                r,STREAM_TAG,MPI_COMM_WORLD,&stream.receives.back());
+    }
+  }
+}
 
-  if (*highestNumber<=2 ) {
-    cout<<"Error: highest number must be greater than 2"
-	<< endl;
-    exit(1);
+/*
+  Routine that sends every piece of this process's block that lies below
+  final, the number from which on the block may still change.  Rank 0
+  keeps its own block.
+*/
+void stream_final(chain_stream &stream,const uint8_t *prime_buf,uint64_t final)
+{
+  if (stream.rank==0 || (stream.output!=OUTPUT_BITS && stream.output!=OUTPUT_DELTA)) return;
+  for ( ; stream.next<stream.bytes; stream.next+=STREAM_BYTES) {
+    uint64_t n = min((uint64_t)STREAM_BYTES,stream.bytes-stream.next);
+    uint64_t low = stream.block_low+stream.next;
+    if ((low+n)*WHEEL_SPAN>final) break;
+    const uint8_t *data = prime_buf+stream.next;
+    if (stream.output==OUTPUT_DELTA) {
+      stream.deltas.push_back(vector<uint8_t>());
+      WheelEncodeDeltas(prime_buf+stream.next,low,n,stream.limit,low*WHEEL_SPAN,stream.deltas.back());
+      n = stream.deltas.back().size();
+      data = stream.deltas.back().empty() ? prime_buf : &stream.deltas.back()[0];
+    }
+    stream.requests.push_back(MPI_REQUEST_NULL);
+    MPI_Isend((void *)data,(int)n,MPI_BYTE,0,STREAM_TAG,MPI_COMM_WORLD,&stream.requests.back());
+    PrimeTraceSent(n);
+  }
+}
+
+/*
+  Routine that returns the number from which on a block may still change
+  once every seed prime up to prime has been struck out.
+*/
+uint64_t final_below(uint64_t prime)
+{
+  return (prime+1)*(prime+1);
+}
+
+/*
+  Routine that runs the pipelined chain.  Rank 0 strikes each seed prime
+  out of its own numbers and collects (prime, next multiple) pairs; every
+  other rank receives a batch, strikes each prime out of its numbers from
+  the multiple that came with it, moves that multiple past its own block
+  and forwards the batch.  Receives and
+  sends are non-blocking and double buffered, so a rank marks batch k
+  while batch k+1 arrives and batch k-1 leaves.  An empty batch ends the
+  chain.
+*/
+void pipelined_chain(int rank,int numtasks,uint8_t *prime_buf,uint64_t num_to_send,
+                     uint64_t rootHighestNumber,int batchSize,ThreadPool *pool,
+                     chain_stream &stream)
+{
+  // one pair is two 64-bit words: the prime and its next multiple
+  uint64_t *batch[2];
+  MPI_Request send_req[2] = {MPI_REQUEST_NULL,MPI_REQUEST_NULL};
+  MPI_Request recv_req[2] = {MPI_REQUEST_NULL,MPI_REQUEST_NULL};
+  MPI_Status status;
+  // numbers past this process's block
+  uint64_t block_end = num_to_send*(rank+1)*WHEEL_SPAN;
+  int cur = 0;
+  int count;
+
+  batch[0] = new uint64_t[2*batchSize];
+  batch[1] = new uint64_t[2*batchSize];
+
+  if (rank==0) {
+    // the seed primes are read from the numbers up to the root, which are
+    // struck out at once; the rest of the block is struck out per batch
+    uint64_t seed_bytes = min(num_to_send,WheelBytes(rootHighestNumber+1));
+    // send a batch on and strike it out of this process's block
+    auto flush = [&]() {
+      PrimeTraceBegin();
+      if (numtasks>1) {
+        MPI_Isend(batch[cur],2*count,MPI_UINT64_T,rank+1,123,MPI_COMM_WORLD,&send_req[cur]);
+        PrimeTraceSent(2*count*sizeof(uint64_t));
+      }
+      PrimeTraceEnd(TRACE_SEND);
+      mark_primes(pool,prime_buf,0,num_to_send,batch[cur],0,2,count);
+      cur ^= 1;
+      // the other buffer may still be on its way
+      PrimeTraceBegin();
+      MPI_Wait(&send_req[cur],MPI_STATUS_IGNORE);
+      PrimeTraceEnd(TRACE_SEND);
+      count = 0;
+    };
+    count = 0;
+    // Primes up to WHEEL_PRESIEVE_MAX were struck out by WheelInit
+    for(uint32_t i=WHEEL_PRESIEVE_MAX+1;i<rootHighestNumber;i++) {
+      if (WheelTest(prime_buf,0,i)) {
+        WheelMark(prime_buf,0,seed_bytes,i);
+        batch[cur][2*count] = i;
+        batch[cur][2*count+1] = next_multiple((uint64_t)i*i,i,block_end);
+        count++;
+        if (count==batchSize) flush();
+      }
+    }
+    // a partial batch, then the empty one that ends the chain
+    if (count>0) flush();
+    if (numtasks>1) {
+      MPI_Isend(batch[cur],0,MPI_UINT64_T,rank+1,123,MPI_COMM_WORLD,&send_req[cur]);
+      PrimeTraceSent(0);
+    }
+  }
+  else {
+    MPI_Irecv(batch[cur],2*batchSize,MPI_UINT64_T,rank-1,123+rank-1,MPI_COMM_WORLD,&recv_req[cur]);
+    do {
+      PrimeTraceBegin();
+      MPI_Wait(&recv_req[cur],&status);
+      PrimeTraceEnd(TRACE_RECV);
+      MPI_Get_count(&status,MPI_UINT64_T,&count);
+      PrimeTraceReceived(count*sizeof(uint64_t));
+      count /= 2;
+      if (count>0) {
+        // the other buffer is free again once its forward has left
+        PrimeTraceBegin();
+        MPI_Wait(&send_req[cur^1],MPI_STATUS_IGNORE);
+        PrimeTraceEnd(TRACE_SEND);
+        MPI_Irecv(batch[cur^1],2*batchSize,MPI_UINT64_T,rank-1,123+rank-1,MPI_COMM_WORLD,&recv_req[cur^1]);
+      }
+      //mark all multiples as non-primes and move each next multiple on
+      mark_primes(pool,prime_buf,num_to_send*rank,num_to_send,batch[cur],batch[cur]+1,2,count);
+      for (int k=0; k<count; k++)
+        batch[cur][2*k+1] = next_multiple(batch[cur][2*k+1],batch[cur][2*k],block_end);
+      if (count>0) {
+        // batches come in increasing order, so what lies below the square
+        // of the next prime is done
+        PrimeTraceBegin();
+        stream_final(stream,prime_buf,final_below(batch[cur][2*count-2]));
+        PrimeTraceEnd(TRACE_SEND);
+      }
+      if (rank<numtasks-1) {
+        PrimeTraceBegin();
+        MPI_Isend(batch[cur],2*count,MPI_UINT64_T,rank+1,123+rank,MPI_COMM_WORLD,&send_req[cur]);
+        PrimeTraceEnd(TRACE_SEND);
+        PrimeTraceSent(2*count*sizeof(uint64_t));
+      }
+      cur ^= 1;
+    } while (count>0);
+  }
+  PrimeTraceBegin();
+  MPI_Waitall(2,send_req,MPI_STATUSES_IGNORE);
+  PrimeTraceEnd(TRACE_SEND);
+
+  delete [] batch[0];
+  delete [] batch[1];
+}
+
+/*
+  Routine that brings the results of every process to rank 0.
+  count: each process counts its primes and the counts are summed.
+  bits:  the wheel bytes that hold numbers up to highestNumber have been
+         streaming to rank 0 since they became final; the rest follow now.
+  delta: the same, with each piece encoded as varint gaps from its start.
+  stats: each thread measures its slice, the slices are merged in order
+         and the processes' statistics are merged in rank order.
+  Rank 0 receives O(N) bytes only in the bits mode, and then 1/30 of N.
+  With -s rank 0 reads the blocks of its own node straight from the
+  shared window instead.
+*/
+void collect_results(int rank,int numtasks,uint8_t *prime_buf,uint64_t num_to_send,
+                     uint64_t highestNumber,output_mode output,chain_stream &stream,
+                     ThreadPool *pool)
+{
+  uint64_t block_low = num_to_send*rank;
+
+  if (output==OUTPUT_COUNT) {
+    uint64_t count = WheelCount(prime_buf,num_to_send);
+    uint64_t total = 0;
+    // 2, 3 and 5 are not stored in the wheel
+    if (rank==0) count += WheelUnstored(highestNumber+1);
+    MPI_Reduce(&count,&total,1,MPI_UINT64_T,MPI_SUM,0,MPI_COMM_WORLD);
+    if (rank==0) cout << "primes=" << total << endl;
+  }
+  else if (output==OUTPUT_STATS) {
+    vector<PrimeStats> slices(pool->Size());
+    pool->Run([&](int t) {
+      uint64_t low, n;
+      ThreadSlice(num_to_send,pool->Size(),t,&low,&n);
+      PrimeStatsAdd(slices[t],prime_buf+low,block_low+low,n,0,highestNumber+1);
+    });
+    PrimeStats stats, total;
+    for (int t=0; t<pool->Size(); t++) PrimeStatsMerge(stats,slices[t]);
+    PrimeStatsReduce(stats,total,MPI_COMM_WORLD);
+    if (rank==0) {
+      cout << "primes=" << total.count << endl;
+      PrimeStatsPrint(total,cout);
+    }
+  }
+  else if (output==OUTPUT_BITS || output==OUTPUT_DELTA) {
+    // whatever was not final yet is now
+    stream_final(stream,prime_buf,UINT64_MAX);
+    // the blocks rank 0 reads in place are done
+    if (stream.nearby[rank]) PrimeNodeSync(*stream.node,*stream.window);
+    if (rank!=0) {
+      MPI_Waitall(stream.requests.size(),stream.requests.empty() ? 0 : &stream.requests[0],
+                  MPI_STATUSES_IGNORE);
+      return;
+    }
+    if (output==OUTPUT_BITS) {
+      memcpy(stream.result,prime_buf,stream.bytes);
+      MPI_Waitall(stream.receives.size(),stream.receives.empty() ? 0 : &stream.receives[0],
+                  MPI_STATUSES_IGNORE);
+      for (int k=1; stream.node && k<stream.node->size; k++) {
+        uint64_t low = num_to_send*stream.node->worldRanks[k];
+        memcpy(stream.result+low,PrimeNodePart(*stream.window,k,0),
+               stream_bytes(low,num_to_send,stream.limit));
+      }
+      for (int r=1; r<numtasks; r++) {
+        uint64_t bytes = stream.nearby[r] ? 0 : stream_bytes(num_to_send*r,num_to_send,stream.limit);
+        for (uint64_t piece=0; piece<bytes; piece+=STREAM_BYTES)
+          PrimeTraceReceived(min((uint64_t)STREAM_BYTES,bytes-piece));
+      }
+#ifdef PRINT_PRIMES
+      WheelForEachPrime(stream.result,0,WheelBytes(stream.limit),stream.limit,
+                        [](uint64_t p) { cout<<p<<"\n"; });
+#endif
+      delete [] stream.result;
+      return;
+    }
+    // gap lists arrive in any order across processes, in order within one
+    vector<vector<vector<uint8_t> > > pieces(numtasks);
+    pieces[0].push_back(vector<uint8_t>());
+    WheelEncodeDeltas(prime_buf,0,stream.bytes,stream.limit,0,pieces[0][0]);
+    // blocks on this node are encoded here, whole
+    for (int k=1; stream.node && k<stream.node->size; k++) {
+      int r = stream.node->worldRanks[k];
+      uint64_t low = num_to_send*r;
+      pieces[r].push_back(vector<uint8_t>());
+      WheelEncodeDeltas(PrimeNodePart(*stream.window,k,0),low,
+                        stream_bytes(low,num_to_send,stream.limit),stream.limit,low*WHEEL_SPAN,
+                        pieces[r][0]);
+    }
+    uint64_t expected = 0;
+    for (int r=1; r<numtasks; r++)
+      if (!stream.nearby[r])
+        expected += (stream_bytes(num_to_send*r,num_to_send,stream.limit)+STREAM_BYTES-1)/STREAM_BYTES;
+    for (uint64_t k=0; k<expected; k++) {
+      MPI_Status status;
+      int n;
+      MPI_Probe(MPI_ANY_SOURCE,STREAM_TAG,MPI_COMM_WORLD,&status);
+      MPI_Get_count(&status,MPI_BYTE,&n);
+      vector<vector<uint8_t> > &from = pieces[status.MPI_SOURCE];
+      from.push_back(vector<uint8_t>(n+1));
+      MPI_Recv(&from.back()[0],n,MPI_BYTE,status.MPI_SOURCE,STREAM_TAG,MPI_COMM_WORLD,
+               MPI_STATUS_IGNORE);
+      from.back().resize(n);
+      PrimeTraceReceived(n);
+    }
+#ifdef PRINT_PRIMES
+    for (int r=0; r<numtasks; r++)
+      for (size_t k=0; k<pieces[r].size(); k++) {
+        uint64_t low = r==0 ? 0 : num_to_send*r+k*STREAM_BYTES;
+        WheelDecodeDeltas(pieces[r][k].empty() ? 0 : &pieces[r][k][0],pieces[r][k].size(),
+                          low*WHEEL_SPAN,[](uint64_t p) { cout<<p<<"\n"; });
+      }
+#endif
   }
 }
 
@@ -73,41 +555,70 @@ void get_max_number(int argc,char *argv[],int *highestNumber) {
 int main( int argc, char *argv[])
 {
 
-  int highestNumber;
-  int rootHighestNumber;
+  uint64_t highestNumber;
+  uint64_t rootHighestNumber;
   int *numberArray;
-  bool *isPrimeArray;
   MPI_Status status;
-  int numtasks,rank, num_to_send;
-  int curr_prime = 2;
-  int last_nonprime;
-
-  MPI_Init(&argc,&argv); // initialize MPI environment
+  int numtasks,rank;
+  uint64_t num_to_send;
+  uint32_t curr_prime = 2;
+  uint64_t last_nonprime;
+  chain_stream stream;
+
+  int thread_support;
+  // initialize MPI environment; only this thread will make MPI calls
+  MPI_Init_thread(&argc,&argv,MPI_THREAD_FUNNELED,&thread_support);
   MPI_Comm_size(MPI_COMM_WORLD,&numtasks); // get total number of MPI processes
   MPI_Comm_rank(MPI_COMM_WORLD,&rank); // get unique rank of the process
+  PrimeTraceInit(MPI_COMM_WORLD); // per-process stage timing, if PRIME_TRACE is set
 
-  int rec_prime, rec_lastnon = 2;
+  uint32_t rec_prime;
+  uint64_t rec_lastnon = 2;
   int type;
-  bool *prime_buf;
+  uint8_t *prime_buf;
+  PrimeMemory prime_memory;
+  bool pipelined;
+  int batchSize;
+  output_mode output;
+  int threads;
+  const char *write_path;
+  PrimeFileFormat write_format;
+  bool shared;
+  PrimeNode node;
+  PrimeNodeWindow window;
 
   rec_prime = 2;
 
   /*
      get matrix sizes
   */
-  get_max_number(argc,argv,&highestNumber);
-
-  // The amount to send to each process
-  num_to_send = ceil((double)(highestNumber+1)/(double)numtasks);
+  get_max_number(argc,argv,&highestNumber,&pipelined,&batchSize,&output,&threads,
+                 &shared,&write_path,&write_format);
+  if (thread_support<MPI_THREAD_FUNNELED) threads = 1;
+  ThreadPool pool(threads);
+
+  // The amount of wheel bytes held by each process, 30 numbers each,
+  // rounded up to whole chunks
+  num_to_send = (WheelBytes(highestNumber+1)+numtasks-1)/numtasks;
+  num_to_send = (num_to_send+BLOCK_ALIGN-1)/BLOCK_ALIGN*BLOCK_ALIGN;
   //cout << highestNumber << endl;
   //cout << numtasks << endl;
 
   //determine square root
-  rootHighestNumber=ceil(sqrt(highestNumber+1));
+  rootHighestNumber=WheelSqrt(highestNumber)+1;
   //cout << "the highest nubmer "<< rootHighestNumber << endl;
 
-  // dynamically allocate
-  prime_buf    = new (nothrow) bool[num_to_send];
+  // dynamically allocate, in huge pages where possible, or with -s as
+  // this process's part of the node's window
+  PrimeTraceBegin();
+  if (shared) {
+    PrimeNodeInit(node,MPI_COMM_WORLD);
+    prime_buf = PrimeNodeAlloc(node,num_to_send,window) ? window.data : 0;
+    prime_memory.data = prime_buf;
+    prime_memory.bytes = num_to_send;
+  }
+  else
+    prime_buf = PrimeMemoryAlloc(prime_memory,num_to_send) ? prime_memory.data : 0;
   // test for correct allocation
   if(prime_buf==0) {
     cout <<"ERROR:  Insufficient Memory" << endl;
@@ -115,56 +626,50 @@ int main( int argc, char *argv[])
     exit(1);
   }
 
-  if(rank==0) {
-    // dynamically allocate
-    //isPrimeArray = new (nothrow) bool[(highestNumber+1)+(highestNumber+1)%numtasks];
-    isPrimeArray = new (nothrow) bool[num_to_send*numtasks];
-    // test for correct allocation
-    if(isPrimeArray==0) {
-      cout <<"ERROR:  Insufficient Memory" << endl;
-      MPI_Finalize(); // Exit MPI
-      exit(1);
-    }
-    //initialize isPrimeArray to true, all non-primes
-    //will be marked false.
-    for ( int i=0;i<highestNumber+1;i++) isPrimeArray[i]=true;
-  }
+  //initialize this process's block to all candidates, all non-primes
+  //will be cleared. The padding past highestNumber starts cleared.
+  init_block(&pool,prime_buf,num_to_send*rank,num_to_send,highestNumber+1);
+  PrimeTraceEnd(TRACE_INIT);
 
   /*
     Start recording the execution time
   */
   TIMER_CLEAR;
   TIMER_START;
+  stream_open(stream,rank,numtasks,num_to_send,highestNumber,output,
+              shared ? &node : 0,shared ? &window : 0);
 
   //This outer loop will go through all the numbers up
   //to the sqaure root of the highest number chosen.
   //At each number, if the number has not been marks as
   //non-prime in the previous iterations, it is prime.
 
-
-  /// Scatter isPrimeArray, put 0 padding on end
-  MPI_Scatter(isPrimeArray,num_to_send,MPI::BOOL,prime_buf,num_to_send,MPI::BOOL,0,MPI_COMM_WORLD);
-
-  /// Broadcast the size of numbers sent to each
-  MPI_Bcast(&num_to_send,1,MPI_INT,0,MPI_COMM_WORLD);
-
-  if (rank==0) {
+  if (rank==0)
     cout << "Largest Number:  " << highestNumber << endl; // Debug
+
+  if (pipelined) {
+    pipelined_chain(rank,numtasks,prime_buf,num_to_send,rootHighestNumber,batchSize,&pool,
+                    stream);
+  }
+  else if (rank==0) {
     type = 123;
-    for(int i=2;i<rootHighestNumber;i++) {
+    // Primes up to WHEEL_PRESIEVE_MAX were struck out by WheelInit
+    for(uint32_t i=WHEEL_PRESIEVE_MAX+1;i<rootHighestNumber;i++) {
       curr_prime = i;
-      last_nonprime = i;
       //check to see if the current number is a prime.
-      if (prime_buf[i]==true){
+      if (WheelTest(prime_buf,0,i)){
         //mark all multiples as non-primes
-        for (int j=i*2 ; j<num_to_send ; j=j+i){
-  	       prime_buf[j]=false;
-           last_nonprime = j;
-        }
+        uint64_t prime = i;
+        mark_primes(&pool,prime_buf,0,num_to_send,&prime,0,1,1);
+        // the last multiple that falls in this process's numbers
+        last_nonprime = (num_to_send*WHEEL_SPAN-1)/i*i;
         if (numtasks>1) {
           // Send what index that was just done to next process, and teh last non prime number
-          MPI_Send(&curr_prime,1,MPI_INT,rank+1,type,MPI_COMM_WORLD);
-          MPI_Send(&last_nonprime,1,MPI_INT,rank+1,type,MPI_COMM_WORLD);
+          uint64_t message[2] = {curr_prime,last_nonprime};
+          PrimeTraceBegin();
+          MPI_Send(message,2,MPI_UINT64_T,rank+1,type,MPI_COMM_WORLD);
+          PrimeTraceEnd(TRACE_SEND);
+          PrimeTraceSent(sizeof(message));
         }
       }
     }
@@ -175,15 +680,24 @@ int main( int argc, char *argv[])
       // Send a large number to indicate that we have done the entire array
       // This indicates that we are done TESTING
       // TODO: handle if the last prime is not in the first process's numbers
-      MPI_Send(&curr_prime,1,MPI_INT,rank+1,type,MPI_COMM_WORLD);
-      MPI_Send(&last_nonprime,1,MPI_INT,rank+1,type,MPI_COMM_WORLD);
+      uint64_t message[2] = {curr_prime,last_nonprime};
+      PrimeTraceBegin();
+      MPI_Send(message,2,MPI_UINT64_T,rank+1,type,MPI_COMM_WORLD);
+      PrimeTraceEnd(TRACE_SEND);
+      PrimeTraceSent(sizeof(message));
     }
   }
   else {
     while(rec_prime<rootHighestNumber) {
       type = 123 + rank - 1;
-      MPI_Recv(&rec_prime,1,MPI_INT,rank-1,type, MPI_COMM_WORLD,&status);
-      MPI_Recv(&rec_lastnon,1,MPI_INT,rank-1,type, MPI_COMM_WORLD,&status);
+      // the prime and the last multiple struck before this block
+      uint64_t message[2];
+      PrimeTraceBegin();
+      MPI_Recv(message,2,MPI_UINT64_T,rank-1,type, MPI_COMM_WORLD,&status);
+      PrimeTraceEnd(TRACE_RECV);
+      PrimeTraceReceived(sizeof(message));
+      rec_prime = (uint32_t)message[0];
+      rec_lastnon = message[1];
 
       // Only do array math if it is a valid number
       if (rec_prime<rootHighestNumber) {
@@ -191,41 +705,67 @@ int main( int argc, char *argv[])
         //cout << "rank " << rank << " Rec Prime " << rec_prime << endl;
         //cout << "rank " << rank << " Last Not " << rec_lastnon << endl;
 
-        //mark all multiples as non-primes
-        for(int j=rec_lastnon+rec_prime-(num_to_send*rank); j<num_to_send; j=j+rec_prime) {
-           prime_buf[j]=false;
-           rec_lastnon = j+num_to_send*rank;
-        }
+        //mark all multiples as non-primes; the first one in this block
+        //is the one that follows rec_lastnon
+        uint64_t prime = rec_prime;
+        uint64_t first = rec_lastnon+rec_prime;
+        mark_primes(&pool,prime_buf,num_to_send*rank,num_to_send,&prime,&first,1,1);
+        rec_lastnon += (num_to_send*(rank+1)*WHEEL_SPAN-1-rec_lastnon)/rec_prime*rec_prime;
+        // send on whatever this prime finished
+        PrimeTraceBegin();
+        stream_final(stream,prime_buf,final_below(rec_prime));
+        PrimeTraceEnd(TRACE_SEND);
       }
       // Send the prime and last non-prime to next process, if it isn't the last
       if(rank<numtasks-1) {
         type = 123 + rank;
         // Send what index that was just done to next process
-        MPI_Send(&rec_prime,1,MPI_INT,rank+1,type,MPI_COMM_WORLD);
-        MPI_Send(&rec_lastnon,1,MPI_INT,rank+1,type,MPI_COMM_WORLD);
+        uint64_t message[2] = {rec_prime,rec_lastnon};
+        PrimeTraceBegin();
+        MPI_Send(message,2,MPI_UINT64_T,rank+1,type,MPI_COMM_WORLD);
+        PrimeTraceEnd(TRACE_SEND);
+        PrimeTraceSent(sizeof(message));
       }
     }
     // Print individual processes arrays
     //cout << "rank = " << rank << endl;
-    //for ( int i=0;i<num_to_send;i++)
-    //  if (prime_buf[i]==true)cout<<rank<<" ===== "<<i<<endl;
+    //WheelForEachPrime(prime_buf,num_to_send*rank,num_to_send,highestNumber+1,
+    //                  [&](uint64_t p) { cout<<rank<<" ===== "<<p<<endl; });
   }
 
-   /// MPI Gather of primeArray
-   MPI_Gather(prime_buf,num_to_send,MPI::BOOL,isPrimeArray,num_to_send,MPI::BOOL,0,MPI_COMM_WORLD);
+   /// Bring the selected results to rank 0
+   PrimeTraceBegin();
+   collect_results(rank,numtasks,prime_buf,num_to_send,highestNumber,output,stream,&pool);
+   PrimeTraceEnd(TRACE_GATHER);
 
   /*
     stop recording the execution time
   */
   TIMER_STOP;
+  PrimeTraceStop();
+  PrimeTraceMemory([&](char *text, size_t size) { PrimeMemoryPlacement(prime_memory,text,size); });
 
   if(rank==0) {
-    //print primes
-    //for ( int i=1;i<highestNumber+1;i++)
-    //  if (isPrimeArray[i]==true)cout<<i<<endl;
-
     cout << "time=" << setprecision(8) <<  TIMER_ELAPSED/1000000.0  << " seconds" << endl;
   }
+  PrimeTraceReport(MPI_COMM_WORLD);
+
+  // every process writes its own block; timed on its own
+  if (write_path) {
+    TIMER_CLEAR;
+    TIMER_START;
+    PrimeFileWrite(write_path,write_format,prime_buf,num_to_send*rank,num_to_send,
+                   highestNumber+1,MPI_COMM_WORLD);
+    TIMER_STOP;
+    if (rank==0)
+      cout << "write=" << setprecision(8) <<  TIMER_ELAPSED/1000000.0  << " seconds" << endl;
+  }
 
+  if (shared) {
+    PrimeNodeRelease(window);
+    PrimeNodeFree(node);
+  }
+  else
+    PrimeMemoryFree(prime_memory);
   MPI_Finalize(); // Exit MPI
 }
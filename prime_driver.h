@@ -0,0 +1,84 @@
+//MIT License
+
+//Copyright (c) 2016 Ashton Johnson
+
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+
+/******************************************************************/
+/**
+* Command line and timing helpers shared by the drivers
+* @file prime_driver.h
+* @author Ashton Johnson, Paul Henny
+* @brief Timer macros and the parsing and checks of the number arguments
+* that the serial, fan-out and daisy-chain programs have in common.
+*/
+#ifndef PRIME_DRIVER_H
+#define PRIME_DRIVER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <iostream>
+
+/*! Timer related definitions, copied from mpbench and moved to the
+ *  monotonic clock so that wall-clock adjustments cannot skew a
+ *  measurement; TIMER_ELAPSED is in microseconds
+ */
+#define TIMER_CLEAR     (tv1.tv_sec = tv1.tv_nsec = tv2.tv_sec = tv2.tv_nsec = 0)
+#define TIMER_START     clock_gettime(CLOCK_MONOTONIC, &tv1)
+#define TIMER_ELAPSED   ((tv2.tv_nsec-tv1.tv_nsec)/1000.0+((tv2.tv_sec-tv1.tv_sec)*1000000.0))
+#define TIMER_STOP      clock_gettime(CLOCK_MONOTONIC, &tv2)
+static struct timespec tv1,tv2;
+
+/** \brief Parses a whole decimal argument; false if it does not start
+ * with a digit, anything else follows or it does not fit 64 bits.
+ *
+ * strtoull would skip leading blanks and take a sign, wrapping " -5" to a
+ * huge number, so the first character must already be a digit.
+ */
+static inline bool PrimeParseNumber(const char *text, uint64_t *value)
+{
+  char *end;
+  errno = 0;
+  *value = strtoull(text, &end, 10);
+  return *text >= '0' && *text <= '9' && *end == '\0' && errno == 0;
+}
+
+/** \brief Exits with a message unless 2 < highestNumber <= maxNumber and
+ * lowestNumber < highestNumber.
+ */
+static inline void PrimeCheckRange(uint64_t highestNumber, uint64_t lowestNumber,
+                                   uint64_t maxNumber)
+{
+  if (highestNumber > maxNumber) {
+    std::cout << "Error: highest number must not exceed " << maxNumber << std::endl;
+    exit(1);
+  }
+  if (highestNumber <= 2) {
+    std::cout << "Error: highest number must be greater than 2" << std::endl;
+    exit(1);
+  }
+  if (lowestNumber >= highestNumber) {
+    std::cout << "Error: lowest number must be below the highest number" << std::endl;
+    exit(1);
+  }
+}
+
+#endif /* PRIME_DRIVER_H */
@@ -0,0 +1,262 @@
+//MIT License
+
+//Copyright (c) 2016 Ashton Johnson
+
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+
+/******************************************************************/
+/**
+* Resumable segmented sieve
+* @file prime_extend.h
+* @author Ashton Johnson, Paul Henny
+* @brief Sieve state that can be grown from N to M without redoing [0, N).
+*
+* A PrimeExtendState holds what a segmented sieve carries from one window
+* to the next.  That is the base primes, the SievingPrime of every active
+* one with the offsets of its next multiples, the number of primes below
+* the end of the last window, and that window's last byte.  Growing it to
+* M sieves only the wheel bytes from there up to M.  It first extends the
+* base primes past the old square root, sieved with the ones it already
+* has.  Nothing below the old end is looked at again.
+*
+* The state is kept in memory between calls or saved to a small file: a
+* PrimeExtendHeader followed by the base primes and the SievingPrimes.  It
+* takes O(sqrt(N)) bytes, unlike a PrimeIndex, which keeps every bit.
+* Saving writes a temporary file and renames it over the old one, so an
+* interrupted run keeps the previous state.
+*
+* The resumed walk does not use buckets, because a bucket ring is sized
+* for a fixed largest prime.
+*/
+#ifndef PRIME_EXTEND_H
+#define PRIME_EXTEND_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "prime_sieve.h"
+
+/// Layout version; files with another version are refused.
+#define PRIME_EXTEND_VERSION 1
+
+/** \brief Start of a saved state. */
+struct PrimeExtendHeader {
+  /// "PRIMEEXT"
+  char magic[8];
+  uint32_t version;
+  /// bitmap of the last sieved byte, endByte - 1
+  uint8_t lastBits;
+  uint8_t unused[3];
+  /// wheel bytes sieved so far: the numbers [0, 30*endByte)
+  uint64_t endByte;
+  /// primes below 30*endByte, 2, 3 and 5 included
+  uint64_t count;
+  /// largest limit the state was grown to; numbers from here on were not visited
+  uint64_t limit;
+  /// the base primes are complete below this
+  uint64_t baseLimit;
+  uint64_t numBase;
+  /// base primes before this one are active, or struck out by WheelInit
+  uint64_t nextPrime;
+  uint64_t numSieving;
+};
+
+/** \brief Everything needed to carry a segmented sieve on. */
+struct PrimeExtendState {
+  uint64_t endByte;
+  uint64_t count;
+  uint8_t lastBits;
+  uint64_t limit;
+  uint64_t baseLimit;
+  std::vector<uint32_t> base;
+  size_t nextPrime;
+  std::vector<SievingPrime> sieving;
+
+  PrimeExtendState() : endByte(0), count(0), lastBits(0), limit(0), baseLimit(0), nextPrime(0) {}
+};
+
+/** \brief Numbers below this are covered by the state. */
+static inline uint64_t PrimeExtendLimit(const PrimeExtendState &st)
+{
+  return st.endByte * WHEEL_SPAN;
+}
+
+/** \brief Completes the base primes below limit.
+ *
+ * The new ones are sieved out of [baseLimit, limit) with the old ones when
+ * those reach its square root; otherwise the list is rebuilt, which only
+ * happens while it is tiny.  Either way the old list stays a prefix, so
+ * nextPrime and the sieving primes remain valid.
+ */
+static inline void PrimeExtendBase(PrimeExtendState &st, uint64_t limit)
+{
+  if (limit <= st.baseLimit) return;
+  if (st.baseLimit == 0 || st.baseLimit * st.baseLimit < limit) {
+    st.base.clear();
+    WheelBasePrimes((uint32_t)limit, st.base);
+  } else {
+    uint64_t lowByte = st.baseLimit / WHEEL_SPAN;
+    uint64_t nBytes = WheelBytes(limit) - lowByte;
+    std::vector<uint8_t> block(nBytes);
+    WheelSieveBlock(&block[0], lowByte, nBytes, limit, st.base, WHEEL_SEGMENT_BYTES);
+    uint64_t from = st.baseLimit;
+    WheelForEachPrime(&block[0], lowByte, nBytes, limit, [&](uint64_t p) {
+      if (p >= from) st.base.push_back((uint32_t)p);
+    });
+  }
+  st.baseLimit = limit;
+}
+
+/** \brief Sieves on from the end of the state up to the byte holding limit - 1.
+ * \param segmentBytes window size, at most WHEEL_MAX_WINDOW
+ * \param visit called as visit(bytes, byteLow, nBytes) with the bytes that
+ * hold [st.limit, limit) once they are sieved: first what is left of the
+ * last byte, then every new window.  Both ends may hold primes outside
+ * that range, and 2, 3 and 5 are reported again by WheelForEachPrime for
+ * a block that starts at byte 0.
+ *
+ * Nothing is visited unless limit is above st.limit, and nothing is sieved
+ * unless it is past the last byte.
+ */
+template <typename Visitor>
+static inline void PrimeExtendTo(PrimeExtendState &st, uint64_t limit, uint32_t segmentBytes,
+                                 Visitor visit)
+{
+  if (limit <= st.limit) return;
+  if (st.endByte > 0) {
+    /// the last byte was sieved to the end but only visited below st.limit
+    uint64_t lastByte = st.endByte - 1;
+    uint8_t bits = st.lastBits;
+    for (int b = 0; b < 8; b++)
+      if (lastByte * WHEEL_SPAN + WHEEL_OFFSET[b] < st.limit) bits &= (uint8_t)~(1u << b);
+    visit((const uint8_t *)&bits, lastByte, (uint32_t)1);
+  }
+  st.limit = limit;
+  uint64_t endByte = WheelBytes(limit);
+  if (endByte <= st.endByte) return;
+  /// every number of the new bytes is sieved; PrimeExtendCount trims the last
+  uint64_t end = endByte * WHEEL_SPAN;
+  PrimeExtendBase(st, WheelSqrt(end) + 1);
+  if (st.nextPrime == 0)
+    while (st.nextPrime < st.base.size() && st.base[st.nextPrime] <= WHEEL_PRESIEVE_MAX)
+      st.nextPrime++;
+
+  if (st.endByte == 0) st.count = WheelUnstored(end);
+  std::vector<uint8_t> segment(segmentBytes);
+  for (uint64_t low = st.endByte; low < endByte; low += segmentBytes) {
+    uint32_t window = (uint32_t)(endByte - low < segmentBytes ? endByte - low : segmentBytes);
+    WheelInit(&segment[0], low, window, end);
+    for (; st.nextPrime < st.base.size() &&
+           (uint64_t)st.base[st.nextPrime] * st.base[st.nextPrime] < (low + window) * WHEEL_SPAN;
+         st.nextPrime++) {
+      SievingPrime sp;
+      SievingPrimeInit(sp, st.base[st.nextPrime], low);
+      st.sieving.push_back(sp);
+    }
+    for (size_t k = 0; k < st.sieving.size(); k++)
+      SieveSegment(&segment[0], window, st.sieving[k]);
+    st.count += WheelCount(&segment[0], window);
+    st.lastBits = segment[window - 1];
+    visit((const uint8_t *)&segment[0], low, window);
+  }
+  st.endByte = endByte;
+}
+
+/** \brief Number of primes below x, for x in the last byte of the state.
+ * \return false if x is not within [30*(endByte-1), 30*endByte]
+ */
+static inline bool PrimeExtendCount(const PrimeExtendState &st, uint64_t x, uint64_t *count)
+{
+  if (st.endByte == 0 || x > PrimeExtendLimit(st) || x < (st.endByte - 1) * WHEEL_SPAN)
+    return false;
+  *count = st.count;
+  uint64_t byte = (st.endByte - 1) * WHEEL_SPAN;
+  for (int b = 0; b < 8; b++)
+    if (byte + WHEEL_OFFSET[b] >= x && (st.lastBits >> b & 1)) (*count)--;
+  /// 2, 3 and 5 are in the count but not in the bits
+  if (st.endByte == 1) *count -= WheelUnstored(WHEEL_SPAN) - WheelUnstored(x);
+  return true;
+}
+
+/** \brief Loads a saved state; a missing file gives an empty one.
+ * \return false if the file exists but is not a valid state
+ */
+static inline bool PrimeExtendLoad(PrimeExtendState &st, const char *path)
+{
+  st = PrimeExtendState();
+  FILE *file = fopen(path, "rb");
+  if (file == 0) return true;
+  PrimeExtendHeader header;
+  bool ok = fread(&header, sizeof(header), 1, file) == 1
+    && memcmp(header.magic, "PRIMEEXT", 8) == 0 && header.version == PRIME_EXTEND_VERSION
+    && header.nextPrime <= header.numBase && header.numSieving <= header.numBase;
+  if (ok) {
+    st.endByte = header.endByte;
+    st.count = header.count;
+    st.limit = header.limit;
+    st.lastBits = header.lastBits;
+    st.baseLimit = header.baseLimit;
+    st.nextPrime = header.nextPrime;
+    st.base.resize(header.numBase);
+    st.sieving.resize(header.numSieving);
+    ok = (st.base.empty() || fread(&st.base[0], sizeof(uint32_t), st.base.size(), file)
+          == st.base.size())
+      && (st.sieving.empty() || fread(&st.sieving[0], sizeof(SievingPrime), st.sieving.size(), file)
+          == st.sieving.size());
+  }
+  fclose(file);
+  if (!ok) st = PrimeExtendState();
+  return ok;
+}
+
+/** \brief Saves a state, replacing the file only once it is written.
+ * \return false if the file could not be written
+ */
+static inline bool PrimeExtendSave(const PrimeExtendState &st, const char *path)
+{
+  PrimeExtendHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "PRIMEEXT", 8);
+  header.version = PRIME_EXTEND_VERSION;
+  header.lastBits = st.lastBits;
+  header.endByte = st.endByte;
+  header.count = st.count;
+  header.limit = st.limit;
+  header.baseLimit = st.baseLimit;
+  header.numBase = st.base.size();
+  header.nextPrime = st.nextPrime;
+  header.numSieving = st.sieving.size();
+
+  std::string temp = std::string(path) + ".tmp";
+  FILE *file = fopen(temp.c_str(), "wb");
+  if (file == 0) return false;
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+    && (st.base.empty() || fwrite(&st.base[0], sizeof(uint32_t), st.base.size(), file)
+        == st.base.size())
+    && (st.sieving.empty() || fwrite(&st.sieving[0], sizeof(SievingPrime), st.sieving.size(), file)
+        == st.sieving.size());
+  ok = (fclose(file) == 0) && ok;
+  if (ok) ok = rename(temp.c_str(), path) == 0;
+  if (!ok) remove(temp.c_str());
+  return ok;
+}
+
+#endif /* PRIME_EXTEND_H */
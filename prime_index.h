@@ -0,0 +1,271 @@
+//MIT License
+
+//Copyright (c) 2016 Ashton Johnson
+
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+
+/******************************************************************/
+/**
+* Persistent prime index shared between runs
+* @file prime_index.h
+* @author Ashton Johnson, Paul Henny
+* @brief Memory-mapped file of sieved wheel blocks with running counts.
+*
+* The file starts with a PrimeIndexHeader padded to PRIME_INDEX_HEADER
+* bytes, followed by one fixed-size record per block of blockBytes wheel
+* bytes: the number of primes below the block, the number in it, then the
+* block's wheel bitmap (eight bits per 30 numbers).  Block b therefore
+* sits at a known offset, so pi(x) costs one table lookup plus a popcount
+* of at most one block, and is-prime a single bit test.
+*
+* Blocks are only ever appended.  A run that needs more than the index
+* covers sieves just the missing blocks, writes them past the end and
+* only then bumps numBlocks in the header, so an interrupted run leaves
+* the index as it was.  A run that is already covered maps the file and
+* sieves nothing.
+*/
+#ifndef PRIME_INDEX_H
+#define PRIME_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include "prime_sieve.h"
+
+/// Bytes reserved for the header at the start of the file.
+#define PRIME_INDEX_HEADER 4096
+
+/// Layout version; files with another version are refused.
+#define PRIME_INDEX_VERSION 1
+
+/// Wheel bytes per block of a new index, about 31 million numbers.
+#ifndef PRIME_INDEX_BLOCK
+#define PRIME_INDEX_BLOCK (1u << 20)
+#endif
+
+/// Bytes in front of the bitmap of every record.
+#define PRIME_INDEX_RECORD_HEAD 16
+
+/** \brief Start of the index file. */
+struct PrimeIndexHeader {
+  /// "PRIMEIDX"
+  char magic[8];
+  uint32_t version;
+  /// wheel bytes per block
+  uint32_t blockBytes;
+  /// complete blocks in the file
+  uint64_t numBlocks;
+};
+
+/** \brief An open index. */
+struct PrimeIndex {
+  int fd;
+  /// the whole file, read only; null while there are no blocks
+  uint8_t *map;
+  size_t mapBytes;
+  uint32_t blockBytes;
+  uint64_t numBlocks;
+};
+
+/** \brief Size of one block record. */
+static inline uint64_t PrimeIndexRecordBytes(const PrimeIndex &idx)
+{
+  return PRIME_INDEX_RECORD_HEAD + (uint64_t)idx.blockBytes;
+}
+
+/** \brief Numbers below this are covered by the index. */
+static inline uint64_t PrimeIndexLimit(const PrimeIndex &idx)
+{
+  return idx.numBlocks * idx.blockBytes * WHEEL_SPAN;
+}
+
+/** \brief Record of block b: primes below it, primes in it, then the bitmap. */
+static inline const uint8_t *PrimeIndexRecord(const PrimeIndex &idx, uint64_t b)
+{
+  return idx.map + PRIME_INDEX_HEADER + b * PrimeIndexRecordBytes(idx);
+}
+
+/** \brief Maps the complete blocks of the file, dropping any older mapping. */
+static inline bool PrimeIndexMap(PrimeIndex &idx)
+{
+  if (idx.map) munmap(idx.map, idx.mapBytes);
+  idx.map = 0;
+  idx.mapBytes = PRIME_INDEX_HEADER + idx.numBlocks * PrimeIndexRecordBytes(idx);
+  if (idx.numBlocks == 0) return true;
+  void *map = mmap(0, idx.mapBytes, PROT_READ, MAP_SHARED, idx.fd, 0);
+  if (map == MAP_FAILED) return false;
+  idx.map = (uint8_t *)map;
+  return true;
+}
+
+/** \brief Unmaps and closes an index. */
+static inline void PrimeIndexClose(PrimeIndex &idx)
+{
+  if (idx.map) munmap(idx.map, idx.mapBytes);
+  idx.map = 0;
+  if (idx.fd >= 0) close(idx.fd);
+  idx.fd = -1;
+}
+
+/** \brief Opens an index, creating an empty one if path does not exist.
+ * \param blockBytes block size used if the index is created
+ * \return false if the file cannot be opened or is not a valid index;
+ * idx is then left closed
+ */
+static inline bool PrimeIndexOpen(PrimeIndex &idx, const char *path,
+                                  uint32_t blockBytes = PRIME_INDEX_BLOCK)
+{
+  idx.map = 0;
+  idx.fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (idx.fd < 0) return false;
+  PrimeIndexHeader header;
+  struct stat st;
+  if (fstat(idx.fd, &st) != 0) {
+    PrimeIndexClose(idx);
+    return false;
+  }
+  if (st.st_size == 0) {
+    std::vector<uint8_t> page(PRIME_INDEX_HEADER, 0);
+    memcpy(header.magic, "PRIMEIDX", 8);
+    header.version = PRIME_INDEX_VERSION;
+    header.blockBytes = blockBytes;
+    header.numBlocks = 0;
+    memcpy(&page[0], &header, sizeof(header));
+    if (pwrite(idx.fd, &page[0], page.size(), 0) != (ssize_t)page.size()) {
+      PrimeIndexClose(idx);
+      return false;
+    }
+  }
+  else if (pread(idx.fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)
+           || memcmp(header.magic, "PRIMEIDX", 8) != 0
+           || header.version != PRIME_INDEX_VERSION || header.blockBytes == 0) {
+    PrimeIndexClose(idx);
+    return false;
+  }
+  idx.blockBytes = header.blockBytes;
+  idx.numBlocks = header.numBlocks;
+  /// a file cut short only keeps the blocks it still holds completely
+  uint64_t held = st.st_size > PRIME_INDEX_HEADER
+    ? (st.st_size - PRIME_INDEX_HEADER) / PrimeIndexRecordBytes(idx) : 0;
+  if (st.st_size != 0 && idx.numBlocks > held) idx.numBlocks = held;
+  if (!PrimeIndexMap(idx)) {
+    PrimeIndexClose(idx);
+    return false;
+  }
+  return true;
+}
+
+/** \brief Sieves and appends the blocks needed to cover [0, limit).
+ * \return false if the file could not be written
+ */
+static inline bool PrimeIndexExtend(PrimeIndex &idx, uint64_t limit)
+{
+  uint64_t needed = (WheelBytes(limit) + idx.blockBytes - 1) / idx.blockBytes;
+  if (needed <= idx.numBlocks) return true;
+  uint64_t end = needed * idx.blockBytes * WHEEL_SPAN;
+  std::vector<uint32_t> primes;
+  WheelBasePrimes((uint32_t)(WheelSqrt(end) + 1), primes);
+
+  uint64_t before = 0;
+  if (idx.numBlocks > 0) {
+    uint64_t last[2];
+    memcpy(last, PrimeIndexRecord(idx, idx.numBlocks - 1), sizeof(last));
+    before = last[0] + last[1];
+  }
+  std::vector<uint8_t> record(PrimeIndexRecordBytes(idx));
+  for (uint64_t b = idx.numBlocks; b < needed; b++) {
+    uint64_t head[2] = {before, 0};
+    WheelSieveBlock(&record[PRIME_INDEX_RECORD_HEAD], b * idx.blockBytes, idx.blockBytes,
+                    end, primes, WHEEL_SEGMENT_BYTES, &head[1]);
+    /// 2, 3 and 5 belong to the first block
+    if (b == 0) head[1] += WheelUnstored(end);
+    memcpy(&record[0], head, sizeof(head));
+    off_t at = PRIME_INDEX_HEADER + b * record.size();
+    if (pwrite(idx.fd, &record[0], record.size(), at) != (ssize_t)record.size()) return false;
+    before += head[1];
+  }
+  /// the blocks are on disk; only now make them part of the index
+  if (fdatasync(idx.fd) != 0) return false;
+  off_t countAt = offsetof(PrimeIndexHeader, numBlocks);
+  if (pwrite(idx.fd, &needed, sizeof(needed), countAt) != (ssize_t)sizeof(needed)) return false;
+  idx.numBlocks = needed;
+  if (!PrimeIndexMap(idx)) {
+    PrimeIndexClose(idx);
+    return false;
+  }
+  return true;
+}
+
+/** \brief Number of primes below x; x must not exceed PrimeIndexLimit. */
+static inline uint64_t PrimeIndexCount(const PrimeIndex &idx, uint64_t x)
+{
+  uint64_t byte = x / WHEEL_SPAN;
+  uint64_t b = byte / idx.blockBytes;
+  if (b >= idx.numBlocks) {
+    if (idx.numBlocks == 0) return 0;
+    uint64_t last[2];
+    memcpy(last, PrimeIndexRecord(idx, idx.numBlocks - 1), sizeof(last));
+    return last[0] + last[1];
+  }
+  const uint8_t *record = PrimeIndexRecord(idx, b);
+  const uint8_t *bits = record + PRIME_INDEX_RECORD_HEAD;
+  uint64_t k = byte - b * idx.blockBytes;
+  uint64_t count;
+  memcpy(&count, record, sizeof(count));
+  if (b == 0) count += WheelUnstored(x);
+  count += WheelCount(bits, k);
+  for (int i = 0; i < 8; i++)
+    if (byte * WHEEL_SPAN + WHEEL_OFFSET[i] < x) count += bits[k] >> i & 1;
+  return count;
+}
+
+/** \brief Whether n is prime; n must be below PrimeIndexLimit. */
+static inline bool PrimeIndexIsPrime(const PrimeIndex &idx, uint64_t n)
+{
+  uint64_t b = n / WHEEL_SPAN / idx.blockBytes;
+  return WheelTest(PrimeIndexRecord(idx, b) + PRIME_INDEX_RECORD_HEAD,
+                   b * idx.blockBytes, n);
+}
+
+/** \brief Calls visit(p) for every prime in [lo, hi), in order; hi must
+ * not exceed PrimeIndexLimit.
+ */
+template <typename Visitor>
+static inline void PrimeIndexForEach(const PrimeIndex &idx, uint64_t lo, uint64_t hi,
+                                     Visitor visit)
+{
+  if (lo >= hi) return;
+  /// wheel bytes [loByte, hiByte) hold the range
+  uint64_t loByte = lo / WHEEL_SPAN, hiByte = WheelBytes(hi);
+  for (uint64_t b = loByte / idx.blockBytes; b * idx.blockBytes < hiByte; b++) {
+    uint64_t blockLow = b * idx.blockBytes;
+    uint64_t start = loByte > blockLow ? loByte - blockLow : 0;
+    uint64_t stop = hiByte - blockLow < idx.blockBytes ? hiByte - blockLow : idx.blockBytes;
+    WheelForEachPrime(PrimeIndexRecord(idx, b) + PRIME_INDEX_RECORD_HEAD + start,
+                      blockLow + start, stop - start, hi,
+                      [&](uint64_t p) { if (p >= lo && p < hi) visit(p); });
+  }
+}
+
+#endif /* PRIME_INDEX_H */
@@ -0,0 +1,190 @@
+//MIT License
+
+//Copyright (c) 2016 Ashton Johnson
+
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+
+/******************************************************************/
+/**
+* Parallel prime list output for the MPI drivers
+* @file prime_io.h
+* @author Ashton Johnson, Paul Henny
+* @brief Every rank writes the primes of its own block into one shared
+* file with collective MPI-IO.
+*
+* The file is the concatenation of the ranks' blocks in rank order.  Each
+* rank first sizes its encoded output, an exclusive scan of those sizes
+* gives its file offset, and the blocks are then encoded and written in
+* rounds of at most about PRIME_IO_BUFFER bytes per rank with
+* MPI_File_write_at_all.  No rank ever holds more than one round.
+*
+* Formats:
+*   raw    one uint64_t per prime, host byte order
+*   delta  LEB128 varint gaps, the first one measured from 0; the gap
+*          stream runs on across rank boundaries
+*   text   one decimal number per line
+*/
+#ifndef PRIME_IO_H
+#define PRIME_IO_H
+
+#include <stdint.h>
+#include <string.h>
+#include <iostream>
+#include <vector>
+#include <mpi.h>
+#include "prime_sieve.h"
+
+/// Target size of the buffer each rank writes per collective round.
+#define PRIME_IO_BUFFER (16u << 20)
+
+/// Wheel bytes encoded between two checks of the buffer size.
+#define PRIME_IO_STEP 4096
+
+/// Layouts of the prime list file.
+enum PrimeFileFormat {
+  PRIME_FILE_RAW,
+  PRIME_FILE_DELTA,
+  PRIME_FILE_TEXT
+};
+
+/** \brief Parses raw, delta or text; returns false for anything else. */
+static inline bool PrimeFileParseFormat(const char *name, PrimeFileFormat *format)
+{
+  if (strcmp(name, "raw") == 0) *format = PRIME_FILE_RAW;
+  else if (strcmp(name, "delta") == 0) *format = PRIME_FILE_DELTA;
+  else if (strcmp(name, "text") == 0) *format = PRIME_FILE_TEXT;
+  else return false;
+  return true;
+}
+
+/** \brief Number of bytes p takes in the file.
+ * \param previous the prime written before p, or 0
+ */
+static inline uint64_t PrimeFileLength(PrimeFileFormat format, uint64_t p, uint64_t previous)
+{
+  if (format == PRIME_FILE_RAW) return sizeof(uint64_t);
+  uint64_t length = 1;
+  if (format == PRIME_FILE_DELTA) {
+    for (uint64_t gap = p - previous; gap >= 0x80; gap >>= 7) length++;
+    return length;
+  }
+  for (; p >= 10; p /= 10) length++;
+  /// and the newline
+  return length + 1;
+}
+
+/** \brief Appends p to out.
+ * \param previous the prime written before p, or 0; set to p
+ */
+static inline void PrimeFilePut(PrimeFileFormat format, uint64_t p, uint64_t &previous,
+                                std::vector<uint8_t> &out)
+{
+  if (format == PRIME_FILE_RAW) {
+    size_t at = out.size();
+    out.resize(at + sizeof(uint64_t));
+    memcpy(&out[at], &p, sizeof(uint64_t));
+  }
+  else if (format == PRIME_FILE_DELTA) {
+    uint64_t gap = p - previous;
+    while (gap >= 0x80) { out.push_back((uint8_t)(gap | 0x80)); gap >>= 7; }
+    out.push_back((uint8_t)gap);
+  }
+  else {
+    char digits[20];
+    int n = 0;
+    for (uint64_t v = p; n == 0 || v; v /= 10) digits[n++] = (char)('0' + v % 10);
+    while (n) out.push_back((uint8_t)digits[--n]);
+    out.push_back('\n');
+  }
+  previous = p;
+}
+
+/** \brief Writes the primes of every rank's block to path, collectively.
+ * \param bytes this rank's block of a sieved wheel array
+ * \param byteLow index of the first byte of the block in the whole array
+ * \param nBytes number of bytes in the block
+ * \param limit only 2, 3 and 5 are checked against it; the block itself
+ * must already be cleared at and above limit
+ * \param low first number of the range, for the same check on 2, 3 and 5
+ *
+ * Blocks have to be in rank order.  An existing file is truncated.
+ */
+static inline void PrimeFileWrite(const char *path, PrimeFileFormat format, const uint8_t *bytes,
+                                  uint64_t byteLow, uint64_t nBytes, uint64_t limit, MPI_Comm comm,
+                                  uint64_t low = 0)
+{
+  int rank;
+  MPI_Comm_rank(comm, &rank);
+
+  /// the delta stream starts from the last prime of the ranks below
+  uint64_t last = WheelLastPrime(bytes, byteLow, nBytes, limit), previous = 0;
+  if (last < low) last = 0;
+  MPI_Exscan(&last, &previous, 1, MPI_UINT64_T, MPI_MAX, comm);
+  if (rank == 0) previous = 0;
+
+  /// size this rank's part, then place it after the parts of the ranks below
+  uint64_t size = 0, offset = 0, total = 0;
+  if (format == PRIME_FILE_RAW) {
+    uint64_t unstored = byteLow == 0 ? WheelUnstored(limit) - WheelUnstored(low) : 0;
+    size = (WheelCount(bytes, nBytes) + unstored) * sizeof(uint64_t);
+  }
+  else {
+    uint64_t prev = previous;
+    WheelForEachPrime(bytes, byteLow, nBytes, limit, [&](uint64_t p) {
+        if (p < low) return;
+        size += PrimeFileLength(format, p, prev);
+        prev = p;
+      });
+  }
+  MPI_Exscan(&size, &offset, 1, MPI_UINT64_T, MPI_SUM, comm);
+  if (rank == 0) offset = 0;
+  MPI_Allreduce(&size, &total, 1, MPI_UINT64_T, MPI_SUM, comm);
+
+  MPI_File file;
+  if (MPI_File_open(comm, (char *)path, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                    MPI_INFO_NULL, &file) != MPI_SUCCESS) {
+    if (rank == 0) std::cout << "ERROR:  Cannot open " << path << std::endl;
+    MPI_Abort(comm, 1);
+  }
+  MPI_File_set_size(file, (MPI_Offset)total);
+
+  std::vector<uint8_t> buffer;
+  buffer.reserve(PRIME_IO_BUFFER + PRIME_IO_STEP * 8 * 21);
+  /// next wheel byte to encode
+  uint64_t next = 0;
+  int more = 1;
+  while (more) {
+    buffer.clear();
+    while (next < nBytes && buffer.size() < PRIME_IO_BUFFER) {
+      uint64_t n = nBytes - next < PRIME_IO_STEP ? nBytes - next : PRIME_IO_STEP;
+      WheelForEachPrime(bytes + next, byteLow + next, n, limit,
+                        [&](uint64_t p) { if (p >= low) PrimeFilePut(format, p, previous, buffer); });
+      next += n;
+    }
+    /// every rank joins every round, with an empty buffer once it is done
+    MPI_File_write_at_all(file, (MPI_Offset)offset, buffer.empty() ? 0 : &buffer[0],
+                          (int)buffer.size(), MPI_BYTE, MPI_STATUS_IGNORE);
+    offset += buffer.size();
+    int mine = next < nBytes;
+    MPI_Allreduce(&mine, &more, 1, MPI_INT, MPI_LOR, comm);
+  }
+  MPI_File_close(&file);
+}
+
+#endif /* PRIME_IO_H */
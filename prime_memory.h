@@ -0,0 +1,189 @@
+//MIT License
+
+//Copyright (c) 2016 Ashton Johnson
+
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+
+/******************************************************************/
+/**
+* Huge page backed sieve arrays
+* @file prime_memory.h
+* @author Ashton Johnson, Paul Henny
+* @brief Allocates the large wheel arrays in 2 MB pages and reports on
+* which NUMA nodes they ended up.
+*
+* An array of at least PRIME_MEMORY_HUGE bytes comes from the hugetlbfs
+* pool (MAP_HUGETLB) when pages are reserved there.  Otherwise it is
+* mapped on a 2 MB boundary and marked MADV_HUGEPAGE, so transparent
+* huge pages back it.  Smaller arrays, and systems with neither, get
+* ordinary pages.
+*
+* Nothing is touched here.  The kernel places each page on the node of
+* the thread that first writes it, so the drivers initialize every slice
+* of an array on the thread of the pool that later sieves it.
+* PrimeMemoryPlacement then asks move_pages where a sample of the pages
+* went.
+*/
+#ifndef PRIME_MEMORY_H
+#define PRIME_MEMORY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <new>
+#include <vector>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+/// Size of a huge page, and the smallest array that asks for them.
+#define PRIME_MEMORY_HUGE (2u << 20)
+
+/// Pages PrimeMemoryPlacement looks up, spread over the array.
+#define PRIME_MEMORY_SAMPLES 1024
+
+/// Highest NUMA node PrimeMemoryPlacement tells apart.
+#define PRIME_MEMORY_NODES 64
+
+/// Where the pages of an array come from.
+enum PrimeMemoryKind {
+  /// reserved huge pages of hugetlbfs
+  MEMORY_HUGETLB,
+  /// ordinary mapping the kernel may back with transparent huge pages
+  MEMORY_THP,
+  /// ordinary pages
+  MEMORY_PAGES
+};
+
+static const char *const PRIME_MEMORY_NAMES[3] = { "hugetlb", "thp", "pages" };
+
+/// An array mapped by PrimeMemoryAlloc.
+struct PrimeMemory {
+  uint8_t *data;
+  /// bytes asked for
+  uint64_t bytes;
+  /// bytes mapped, a whole number of pages
+  uint64_t mapped;
+  PrimeMemoryKind kind;
+
+  PrimeMemory() : data(0), bytes(0), mapped(0), kind(MEMORY_PAGES) {}
+};
+
+/** \brief Maps an array of bytes bytes, in huge pages where possible.
+ * \return false if there is not enough memory
+ *
+ * The contents are undefined until the array is initialized.
+ */
+static inline bool PrimeMemoryAlloc(PrimeMemory &mem, uint64_t bytes)
+{
+  mem = PrimeMemory();
+  mem.bytes = bytes;
+#ifdef __linux__
+  uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+  mem.mapped = ((bytes > 0 ? bytes : 1) + page - 1) / page * page;
+  if (bytes >= PRIME_MEMORY_HUGE) {
+    mem.mapped = (bytes + PRIME_MEMORY_HUGE - 1) / PRIME_MEMORY_HUGE * PRIME_MEMORY_HUGE;
+#ifdef MAP_HUGETLB
+    void *map = mmap(0, mem.mapped, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (map != MAP_FAILED) {
+      mem.data = (uint8_t *)map;
+      mem.kind = MEMORY_HUGETLB;
+      return true;
+    }
+#endif
+    /// map one huge page more and trim it to a 2 MB boundary
+    uint64_t padded = mem.mapped + PRIME_MEMORY_HUGE;
+    void *map2 = mmap(0, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map2 == MAP_FAILED) return false;
+    uintptr_t start = (uintptr_t)map2;
+    uintptr_t aligned = (start + PRIME_MEMORY_HUGE - 1) & ~(uintptr_t)(PRIME_MEMORY_HUGE - 1);
+    if (aligned > start) munmap(map2, aligned - start);
+    if (aligned + mem.mapped < start + padded)
+      munmap((void *)(aligned + mem.mapped), start + padded - aligned - mem.mapped);
+    mem.data = (uint8_t *)aligned;
+#ifdef MADV_HUGEPAGE
+    if (madvise(mem.data, mem.mapped, MADV_HUGEPAGE) == 0) mem.kind = MEMORY_THP;
+#endif
+    return true;
+  }
+  void *map = mmap(0, mem.mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) return false;
+  mem.data = (uint8_t *)map;
+  return true;
+#else
+  mem.mapped = bytes;
+  mem.data = new (std::nothrow) uint8_t[bytes > 0 ? bytes : 1];
+  return mem.data != 0;
+#endif
+}
+
+/** \brief Unmaps an array from PrimeMemoryAlloc. */
+static inline void PrimeMemoryFree(PrimeMemory &mem)
+{
+  if (mem.data == 0) return;
+#ifdef __linux__
+  munmap(mem.data, mem.mapped);
+#else
+  delete [] mem.data;
+#endif
+  mem.data = 0;
+}
+
+/** \brief Describes the page kind and the nodes holding the array.
+ * \param text receives for example "thp n0:50% n1:50%"; "-" stands for
+ * pages not touched yet, "n?" for no NUMA information
+ *
+ * Looks up PRIME_MEMORY_SAMPLES pages spread evenly over the array.
+ */
+static inline void PrimeMemoryPlacement(const PrimeMemory &mem, char *text, size_t size)
+{
+  int used = snprintf(text, size, "%s", PRIME_MEMORY_NAMES[mem.kind]);
+#ifdef __linux__
+  uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+  uint64_t pages = (mem.bytes + page - 1) / page;
+  if (pages == 0 || used < 0 || (size_t)used >= size) return;
+  uint64_t stride = (pages + PRIME_MEMORY_SAMPLES - 1) / PRIME_MEMORY_SAMPLES;
+  std::vector<void *> addresses;
+  for (uint64_t p = 0; p < pages; p += stride) addresses.push_back(mem.data + p * page);
+  std::vector<int> status(addresses.size(), -1);
+  /// with no target nodes, move_pages only reports where the pages are
+  if (syscall(__NR_move_pages, 0, (unsigned long)addresses.size(), &addresses[0], (void *)0,
+              &status[0], 0) != 0) {
+    snprintf(text + used, size - used, " n?");
+    return;
+  }
+  uint64_t nodes[PRIME_MEMORY_NODES + 1];
+  memset(nodes, 0, sizeof(nodes));
+  for (size_t k = 0; k < status.size(); k++)
+    nodes[status[k] >= 0 && status[k] < PRIME_MEMORY_NODES ? status[k] : PRIME_MEMORY_NODES]++;
+  for (int n = 0; n <= PRIME_MEMORY_NODES && (size_t)used < size; n++) {
+    if (nodes[n] == 0) continue;
+    int percent = (int)((nodes[n] * 100 + status.size() / 2) / status.size());
+    if (n < PRIME_MEMORY_NODES)
+      used += snprintf(text + used, size - used, " n%d:%d%%", n, percent);
+    else
+      used += snprintf(text + used, size - used, " -:%d%%", percent);
+  }
+#endif
+}
+
+#endif /* PRIME_MEMORY_H */
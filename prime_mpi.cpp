@@ -40,13 +40,61 @@
 //   prime_mpi.cpp
 //   then execute the following command
 //      gnu compiler
-//         mpic++ prime_mpi.cpp -o prime_mpi -lm  -O3
+//         mpic++ prime_mpi.cpp -o prime_mpi -lm  -O3 -pthread
 /*
   Parallel data passing model.  The prime to check the data sample
   is passed to each process after the previous finishes.
 
   To execute:
-  prime_mpi max_numb
+  prime_mpi [--mode fanout|local|dynamic] [--batch primes] [--segment numbers]
+            [--threads n] [--shared] [--count] [--output file [--format raw|delta|text]]
+            [--from min_numb] max_numb
+
+  fanout (default) rank 0 finds the seed primes and broadcasts them to all
+                   ranks in batches of --batch primes (default PRIME_BATCH).
+  local            every rank finds the seed primes itself and sieves its
+                   own block without any messages.
+  dynamic          the range is cut into segments of --segment numbers
+                   (default DYNAMIC_SEGMENT wheel bytes) that rank 0 hands
+                   out on request.  Rank 0 sieves segments too and answers
+                   requests between them, so ranks that are slower or
+                   busier take fewer.  Segments are counted and dropped, so
+                   this mode does not support --output.
+
+  --threads runs n threads inside every rank, each sieving its own slice
+  of the rank's block; only the main thread calls MPI (MPI_THREAD_FUNNELED).
+
+  --shared keeps one table of seed primes per node, in an MPI shared
+  memory window (see prime_node.h), instead of one per rank.  In fan-out
+  mode rank 0 sends the whole table once, to one rank per node, and every
+  rank strikes it out of its block straight from the window; the batches
+  are not broadcast.  In local and dynamic mode one rank per node sieves
+  the table.  Every rank also sieves its block (in dynamic mode its
+  segment) straight into its part of a second node window, where the
+  other ranks of the node can read it in place.  The totals of --count
+  and --stats are still reduced with MPI collectives, and --output still
+  writes with MPI-IO; those steps do not read other ranks' blocks.
+
+  --count prints the number of primes below max_numb.  Every rank counts
+  its own block and the counts are summed on rank 0 with MPI_Reduce.
+
+  --output writes the primes to file, every rank its own block with
+  collective MPI-IO (see prime_io.h), in raw (default), delta or text form.
+
+  --from sieves only [min_numb, max_numb): that range is what gets split
+  across ranks and threads, while the seed primes still run up to
+  sqrt(max_numb).
+
+  --stats also counts twin primes, prime triplets and quadruplets, sums
+  the primes and lists the maximal gaps (see prime_stats.h).  The local
+  mode takes each window while it is in cache, the fan-out mode takes the
+  block once it is sieved.  Every thread keeps its own statistics; they
+  are merged in slice order and then across ranks, in rank order, with a
+  custom MPI_Reduce operation.  Not available in dynamic mode, whose
+  segments are not in order on any rank.
+
+  PRIME_TRACE=1 in the environment prints how long each rank spent in
+  every stage (see prime_trace.h); PRIME_TRACE=file writes it as CSV.
 */
 
 
@@ -59,59 +107,183 @@ using namespace std;
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
-#include <sys/time.h>
+#include <time.h>
+#include <vector>
 #include <mpi.h>
+#include "prime_driver.h"
+#include "prime_sieve.h"
+#include "prime_threads.h"
+#include "prime_io.h"
+#include "prime_trace.h"
+#include "prime_memory.h"
+#include "prime_stats.h"
+#include "prime_node.h"
 
 
 /*! PRIME_EXIT is value passed to indicated there are not more values to 
-  / distribute from the master to slave processes. 
+  / distribute from the master to slave processes. It terminates the
+  / last batch of seed primes.
 */
-#define PRIME_EXIT (int)-1
+#define PRIME_EXIT (uint32_t)-1
 
-/*! MPI Tag used for communication
+/*! Default number of seed primes shipped per broadcast batch
  */
-#define MARK_PRIME_TAG (int)7
+#define PRIME_BATCH 512
 
-/*! Timer related definitions 
+/*! Default wheel bytes per segment in dynamic mode, 30 numbers each
  */
-#define TIMER_CLEAR     (tv1.tv_sec = tv1.tv_usec = tv2.tv_sec = tv2.tv_usec = 0)
-#define TIMER_START     gettimeofday(&tv1, (struct timezone*)0)
-#define TIMER_ELAPSED   ((tv2.tv_usec-tv1.tv_usec)+((tv2.tv_sec-tv1.tv_sec)*1000000))
-#define TIMER_STOP      gettimeofday(&tv2, (struct timezone*)0)
-struct timeval tv1,tv2;
+#define DYNAMIC_SEGMENT (1u<<18)
+
+/*! Tags of the segment requests sent to rank 0 and of its replies
+ */
+#define TAG_REQUEST 1
+#define TAG_SEGMENT 2
+
+/*! SEGMENT_DONE is the reply telling a worker that no segments are left
+ */
+#define SEGMENT_DONE (uint64_t)-1
+
+/*! Ways of distributing the sieving work, selected with --mode
+ */
+enum SieveMode {
+  /// rank 0 sends every seed prime to all other ranks
+  MODE_FANOUT,
+  /// every rank computes the seed primes and sieves its block alone
+  MODE_LOCAL,
+  /// rank 0 hands out segments of the range to whichever rank asks
+  MODE_DYNAMIC
+};
 
 /// highest number passed from the user to check all numbers for prime eligibility 
-int highestNumber;
+uint64_t highestNumber;
+/// first number of the range (--from), 0 by default
+uint64_t lowestNumber;
 /// square root of highestNumber
-int rootHighestNumber;
-/// pointer for value of the local array size
-int *localArraySize;
+uint64_t rootHighestNumber;
+/// pointer for value of the local array size, in wheel bytes
+uint64_t *localArraySize;
+/// index of the first wheel byte held by the local array
+uint64_t localArrayLow;
 /// pointers for arrays of all number and the local processes array
 int *numberArray, *localNumberArray;
-/// pointers for arrays indicating whether or not the number is prime
-bool *isPrimeArray, *lclIsPrimeArray;
+/// pointers for wheel arrays indicating whether or not the number is prime
+uint8_t *isPrimeArray, *lclIsPrimeArray;
+/// huge pages backing lclIsPrimeArray
+PrimeMemory lclMemory;
 /// MPI Specifics for the number or processes and the rank
 int numProc, myRank;
+/// sieving mode selected on the command line
+SieveMode sieveMode;
+/// number of seed primes per broadcast batch in fan-out mode
+uint32_t primeBatchSize;
+/// wheel bytes per segment in dynamic mode
+uint64_t segmentBytes;
+/// number of sieving threads per rank
+int numThreads;
+/// pool running the sieving threads of this rank
+ThreadPool *threadPool;
+/// whether the primes are counted (--count)
+bool countPrimes;
+/// whether the prime statistics are gathered (--stats)
+bool primeStats;
+/// whether the seed primes are shared by the ranks of a node (--shared)
+bool nodeShared;
+/// ranks sharing this rank's node, with --shared
+PrimeNode primeNode;
+/// the node's table of seed primes, with --shared
+PrimeNodeWindow seedWindow;
+/// the node's blocks, this rank's part holding lclIsPrimeArray, with --shared
+PrimeNodeWindow blockWindow;
+/// file the primes are written to (--output), or 0
+const char *outputPath;
+/// layout of that file (--format)
+PrimeFileFormat outputFormat;
 MPI_Comm   *mpiPrimeComm;
 MPI_Group  *world_group;
 
 /**
    Routine to retrieve the highest number to search for all lower valued possibilities of prime numbers
+   and the sieving mode.
 */
-void GetMaxNumber(int argc,char *argv[],int *highestNumber) {
-  if(argc!=2) {//if it is not two arguments (including the program name)
-    cout<<"usage:  prime <highestNumber"
+void GetMaxNumber(int argc,char *argv[],uint64_t *highestNumber,SieveMode *sieveMode,
+		  uint32_t *primeBatchSize,uint64_t *segmentBytes,int *numThreads,bool *countPrimes,
+		  const char **outputPath,PrimeFileFormat *outputFormat,uint64_t *lowestNumber,
+		  bool *stats,bool *shared) {
+  char *end;
+  int arg=1;
+  *sieveMode=MODE_FANOUT;
+  *primeBatchSize=PRIME_BATCH;
+  *segmentBytes=DYNAMIC_SEGMENT;
+  *numThreads=1;
+  *countPrimes=false;
+  *stats=false;
+  *shared=false;
+  *outputPath=0;
+  *outputFormat=PRIME_FILE_RAW;
+  *lowestNumber=0;
+  while(arg<argc-1) {
+    if(strcmp(argv[arg],"--count")==0) {
+      *countPrimes=true;
+      arg++;
+    }
+    else if(strcmp(argv[arg],"--stats")==0) {
+      *stats=true;
+      arg++;
+    }
+    else if(strcmp(argv[arg],"--shared")==0) {
+      *shared=true;
+      arg++;
+    }
+    else if(strcmp(argv[arg],"--mode")==0 && arg+1<argc-1) {
+      if(strcmp(argv[arg+1],"fanout")==0) *sieveMode=MODE_FANOUT;
+      else if(strcmp(argv[arg+1],"local")==0) *sieveMode=MODE_LOCAL;
+      else if(strcmp(argv[arg+1],"dynamic")==0) *sieveMode=MODE_DYNAMIC;
+      else break;
+      arg+=2;
+    }
+    else if(strcmp(argv[arg],"--segment")==0 && arg+1<argc-1) {
+      /// whole cache lines of wheel bytes
+      uint64_t numbers;
+      if(!PrimeParseNumber(argv[arg+1],&numbers) || numbers<1) break;
+      *segmentBytes=(WheelBytes(numbers)+63)/64*64;
+      arg+=2;
+    }
+    else if(strcmp(argv[arg],"--batch")==0 && arg+1<argc-1) {
+      *primeBatchSize=strtoul(argv[arg+1],&end,10);
+      if(*end!='\0' || *primeBatchSize<1) break;
+      arg+=2;
+    }
+    else if(strcmp(argv[arg],"--from")==0 && arg+1<argc-1) {
+      if(!PrimeParseNumber(argv[arg+1],lowestNumber)) break;
+      arg+=2;
+    }
+    else if(strcmp(argv[arg],"--output")==0 && arg+1<argc-1) {
+      *outputPath=argv[arg+1];
+      arg+=2;
+    }
+    else if(strcmp(argv[arg],"--format")==0 && arg+1<argc-1) {
+      if(!PrimeFileParseFormat(argv[arg+1],outputFormat)) break;
+      arg+=2;
+    }
+    else if(strcmp(argv[arg],"--threads")==0 && arg+1<argc-1) {
+      *numThreads=strtol(argv[arg+1],&end,10);
+      if(*end!='\0' || *numThreads<1) break;
+      arg+=2;
+    }
+    else break;
+  }
+  if(arg!=argc-1) {//the highest number must be the last argument
+    cout<<"usage:  prime_mpi [--mode fanout|local|dynamic] [--batch primes] [--segment numbers]"
+	<<" [--threads n] [--shared] [--count] [--stats] [--output file [--format raw|delta|text]]"
+	<<" [--from lowestNumber] <highestNumber>"
 	<< endl;
     exit(1);
   }
-  else {
-    
-    *highestNumber = atoi(argv[1]);
-       
-  }
+  else if (!PrimeParseNumber(argv[arg],highestNumber)) *highestNumber=0;
   
-  if (*highestNumber<=2 ) {
-    cout<<"Error: highest number must be greater than 2"
+  PrimeCheckRange(*highestNumber,*lowestNumber,WHEEL_MAX_LIMIT);
+  if (*sieveMode==MODE_DYNAMIC && (*outputPath || *stats)) {
+    cout<<"Error: --output and --stats need --mode fanout or local"
 	<< endl;
     exit(1);
   }
@@ -131,75 +303,210 @@ void PrintMatrix(float *array,int dim_m,int dim_n)
   }
 }
 
+/** \brief Initializes the local block, every thread its own slice.
+ * \param isPrimeArray wheel array for the numbers covered in the 
+ * local process
+ *
+ * Each thread first touches the slice MarkBatch later gives it, so the
+ * kernel puts those pages on that thread's NUMA node.
+ */
+void InitLocalArray(uint8_t isPrimeArray[])
+{
+  threadPool->Run([&](int t) {
+      uint64_t low, n;
+      ThreadSlice(*localArraySize,threadPool->Size(),t,&low,&n);
+      WheelInit(isPrimeArray+low,localArrayLow+low,n,highestNumber);
+    });
+}
+
+/** \brief Strikes a batch of seed primes out of the local block.
+ * \param isPrimeArray wheel array for the numbers covered in the 
+ * local process
+ * \param primes the batch
+ * \param count number of primes in the batch
+ *
+ * Every thread of the pool strikes the whole batch out of its own slice
+ * of the block.
+ */
+void MarkBatch(uint8_t isPrimeArray[], const uint32_t *primes, uint32_t count)
+{
+  threadPool->Run([&](int t) {
+      uint64_t low, n;
+      ThreadSlice(*localArraySize,threadPool->Size(),t,&low,&n);
+      /// Every multiple p*q with q coprime to 30 is one of eight strided
+      /// progressions through the wheel bytes.
+      for (uint32_t k=0; k<count; k++)
+	WheelMark(isPrimeArray+low,localArrayLow+low,n,primes[k]);
+    });
+}
+
+/** \brief Counts the primes left in the local block.
+ * \param isPrimeArray wheel array for the numbers covered in the 
+ * local process
+ *
+ * Every thread counts its own slice with WheelCount; 2, 3 and 5 are
+ * added by the rank that holds the start of the array, if in range.
+ */
+uint64_t CountLocalPrimes(const uint8_t isPrimeArray[])
+{
+  vector<uint64_t> counts(threadPool->Size(),0);
+  threadPool->Run([&](int t) {
+      uint64_t low, n;
+      ThreadSlice(*localArraySize,threadPool->Size(),t,&low,&n);
+      counts[t]=WheelCount(isPrimeArray+low,n);
+    });
+  uint64_t count=(localArrayLow==0) ? WheelUnstored(highestNumber)-WheelUnstored(lowestNumber) : 0;
+  for (size_t t=0; t<counts.size(); t++) count+=counts[t];
+  return count;
+}
+
+/** \brief Gathers the statistics of the primes in the local block.
+ * \param isPrimeArray wheel array for the numbers covered in the 
+ * local process, sieved
+ * \param stats receives the statistics of the block
+ *
+ * Every thread takes its own slice; the slices are merged in order.
+ */
+void LocalStats(const uint8_t isPrimeArray[], PrimeStats *stats)
+{
+  vector<PrimeStats> slices(threadPool->Size());
+  threadPool->Run([&](int t) {
+      uint64_t low, n;
+      ThreadSlice(*localArraySize,threadPool->Size(),t,&low,&n);
+      PrimeStatsAdd(slices[t],isPrimeArray+low,localArrayLow+low,n,lowestNumber,highestNumber);
+    });
+  *stats=PrimeStats();
+  for (size_t t=0; t<slices.size(); t++) PrimeStatsMerge(*stats,slices[t]);
+}
+
+/** \brief Finds the seed primes, up to and including the root of the
+ * highest number.
+ * \param broadcast with --shared, whether rank 0 sieves them and sends
+ * them to the other nodes; otherwise every node sieves its own
+ * \param seedPrimes holds them without --shared
+ * \param primes receives the seed primes: seedPrimes, or the node's table
+ * in seedWindow
+ * \param count receives the number of seed primes
+ */
+void SeedPrimes(bool broadcast, vector<uint32_t> &seedPrimes, const uint32_t **primes,
+		size_t *count)
+{
+  PrimeTraceBegin();
+  if (nodeShared) {
+    if (!PrimeNodeBasePrimes(primeNode,rootHighestNumber+1,broadcast,seedWindow,primes,count)) {
+      cout <<"Rank:"<<myRank<<"\tERROR:  Insufficient Memory" << endl;
+      exit(1);
+    }
+    if (broadcast && primeNode.rank==0) {
+      if (myRank==0) PrimeTraceSent(*count*sizeof(uint32_t));
+      else PrimeTraceReceived(*count*sizeof(uint32_t));
+    }
+  }else{
+    WheelBasePrimes(rootHighestNumber+1,seedPrimes);
+    *primes=seedPrimes.empty() ? 0 : &seedPrimes[0];
+    *count=seedPrimes.size();
+  }
+  PrimeTraceEnd(TRACE_INIT);
+}
+
 /** \brief Sieves through local numbers to mark off primes.
  * \param myRank MPI rank of the local process within. 
- * \param numProc MPI total number of proccesses.
- * \param localArraySize amount of numbers covered by the local array.
- * \param isPrimeArray boolean array for the numbers covers in the 
+ * \param isPrimeArray wheel array for the numbers covered in the 
  * local process
  * 
- * Detailed Description
+ * Rank 0 walks the numbers up to the square root of the highest number
+ * in a small seed array. Every candidate still set there is a prime; it
+ * is struck out of the seed array before the walk moves on and appended
+ * to the current batch. Full batches of primeBatchSize primes go to all
+ * ranks with MPI_Ibcast. The last batch is terminated by PRIME_EXIT.
+ * Every rank, rank 0 included, strikes each batch out of its block with
+ * MarkBatch.
+ *
+ * Two batch buffers are used on every rank. Rank 0 fills one while the
+ * other is in flight; the other ranks post the broadcast of batch k+1
+ * before they strike out batch k.
  */
-void ComputePrimes(int myRank, int numProc,  int *localArraySize, bool  isPrimeArray[])
+void ComputePrimes(int myRank, uint8_t  isPrimeArray[])
 {
 #ifdef DEBUG
   cout<<"Rank:"<<myRank<<"\tComputing Primes."<<endl;
 #endif     
-  /// Holds the recieved value of mutliples to mark off
-  int *primeToMark= new (nothrow) int;
-  /// Dynamic lowest index of the local array. Increases as lowest value
-  /// is marked off
-  int lowestIndex=myRank*(*localArraySize);
-  /// Initial, unchanging lowest index of the local array
-  const int baseIndex=lowestIndex;
-  /// Dynamic highest index of the local array. Increases as lowest values
-  int highestIndex=myRank*(*localArraySize)+(*localArraySize);
-  /// Initial, unchangin highest index of the local array
-  const int baseUpperIndex=highestIndex;
-  /// lowestMultiple is used to set lowest bounds of for loop that will be
-  /// used to mark off values
-  int lowestMultiple=lowestIndex;
-  /// highestMultiple is used to set lowest bounds of for loop that will be
-  /// used to mark off values
-  int highestMultiple=highestIndex;
+  /// Double buffered batches of primes to mark off
+  vector<uint32_t> batch[2];
+  batch[0].resize(primeBatchSize);
+  batch[1].resize(primeBatchSize);
+  /// Outstanding broadcast of each batch buffer
+  MPI_Request batchRequest[2]={MPI_REQUEST_NULL,MPI_REQUEST_NULL};
+  /// Batch buffer currently being filled or marked
+  int cur=0;
 
   if (myRank==0){
-    /// Set highest index. Initially it will be the root highest number,
-    /// but that might be lowered based upon what gets marked off.
-    highestIndex=min(highestIndex,rootHighestNumber);
-    /// Start sending numbers from Rank 0.
-    for ( int i=2; i<highestIndex; i++){
+    /// Array the seed primes are read from. It only covers the numbers
+    /// up to the square root, so each prime is struck out of it at once
+    /// while the block waits for whole batches.
+    PrimeTraceBegin();
+    uint64_t seedBytes=WheelBytes(rootHighestNumber+1);
+    uint8_t *seedArray=new (nothrow) uint8_t[seedBytes];
+    if (seedArray==0) {
+      cout <<"Rank:"<<myRank<<"\tERROR:  Insufficient Memory" << endl;
+      exit(1);
+    }
+    WheelInit(seedArray,0,seedBytes,rootHighestNumber+1);
+    PrimeTraceEnd(TRACE_INIT);
+    /// Number of primes in the batch being filled
+    uint32_t batchCount=0;
+    /// Start sending numbers from Rank 0. Every rank's WheelInit already
+    /// struck out the primes up to WHEEL_PRESIEVE_MAX, so start past it.
+    for ( uint32_t i=WHEEL_PRESIEVE_MAX+1; i<=rootHighestNumber; i++){
 #ifdef DEBUG
       cout<<endl<<"Checking: "<<i;
 #endif
       /// Check to see if the current number is a prime. 
-      if (isPrimeArray[i]==true){
+      if (WheelTest(seedArray,0,i)){
+	WheelMark(seedArray,0,seedBytes,i);
+
+	batch[cur][batchCount++]=i;
+	if (batchCount==primeBatchSize){
 #ifdef DEBUG
-	cout<<" Sending..."<<endl;
+	  cout<<" Sending batch..."<<endl;
 #endif
-	/// Send number to all other ranks.
-	*primeToMark=i;
-	for( int dst=myRank+1; dst<numProc;dst++)
-	  MPI_Send(primeToMark, 1, MPI_INT, dst, MARK_PRIME_TAG, MPI_COMM_WORLD);
-    
-	/// Update local primes.
-	for (int j=i*2 ; j<baseUpperIndex ; j+=i)
-	  isPrimeArray[j]=false;   //mark all multiples as non-primes    
-      
+	  /// Send the full batch to all other ranks and update local
+	  /// primes, then make sure the other buffer is no longer in
+	  /// flight before refilling it.
+	  PrimeTraceBegin();
+	  MPI_Ibcast(&batch[cur][0],primeBatchSize,MPI_UINT32_T,0,MPI_COMM_WORLD,&batchRequest[cur]);
+	  PrimeTraceEnd(TRACE_SEND);
+	  PrimeTraceSent(primeBatchSize*sizeof(uint32_t));
+	  PrimeTraceBegin();
+	  MarkBatch(isPrimeArray,&batch[cur][0],batchCount);
+	  PrimeTraceEnd(TRACE_MARK);
+	  cur^=1;
+	  PrimeTraceBegin();
+	  MPI_Wait(&batchRequest[cur],MPI_STATUS_IGNORE);
+	  PrimeTraceEnd(TRACE_SEND);
+	  batchCount=0;
+	}
       }
     }
+    delete [] seedArray;
 #ifdef DEBUG
     cout<<"Sending EXIT..."<<endl;
 #endif
-    /// Send exit by sending the PRIME_EXIT constat to other proccesses.
-    *primeToMark=PRIME_EXIT;
-    for( int dst=myRank+1; dst<numProc;dst++) 
-      MPI_Send(primeToMark, 1, MPI_INT, dst, MARK_PRIME_TAG, MPI_COMM_WORLD);
+    /// Send exit by terminating the last batch with the PRIME_EXIT constant.
+    batch[cur][batchCount]=PRIME_EXIT;
+    PrimeTraceBegin();
+    MPI_Ibcast(&batch[cur][0],primeBatchSize,MPI_UINT32_T,0,MPI_COMM_WORLD,&batchRequest[cur]);
+    PrimeTraceEnd(TRACE_SEND);
+    PrimeTraceSent(primeBatchSize*sizeof(uint32_t));
+    PrimeTraceBegin();
+    MarkBatch(isPrimeArray,&batch[cur][0],batchCount);
+    PrimeTraceEnd(TRACE_MARK);
+    PrimeTraceBegin();
+    MPI_Waitall(2,batchRequest,MPI_STATUSES_IGNORE);
+    PrimeTraceEnd(TRACE_SEND);
 #ifdef DEBUG
-    for ( int i=2; i<baseUpperIndex; i++){    
-      if (isPrimeArray[i-baseIndex]==true ) 
-	cout<<"R:"<<myRank<<"\t"<<i<<" is Prime."<<endl;
-    }
+    WheelForEachPrime(isPrimeArray,localArrayLow,*localArraySize,highestNumber,
+		      [&](uint64_t p) { cout<<"R:"<<myRank<<"\t"<<p<<" is Prime."<<endl; });
 #endif
     return;
     
@@ -207,76 +514,252 @@ void ComputePrimes(int myRank, int numProc,  int *localArraySize, bool  isPrimeA
     
     /// Slave Thread Work
   }else{   
+    MPI_Ibcast(&batch[cur][0],primeBatchSize,MPI_UINT32_T,0,MPI_COMM_WORLD,&batchRequest[cur]);
     /// Run indefinitely until receiving PRIME_EXIT 
     while(1)
       {
     
 #ifdef DEBUG
-	for ( int i=lowestIndex; i<highestIndex; i++)
-	  cout<<i<<"\t"<<(int)isPrimeArray[i-baseIndex]<<endl;
-	cout<<"Rank:"<<myRank<<"\tloMultiple:"<<lowestMultiple<<"\thiMultiple:"<<highestMultiple;
-	cout<<"\tloIndex:"<<lowestIndex;
-	cout<<"\thiIndex:"<<highestIndex<<endl;
 	cout<<"R:"<<myRank<<"  Waiting to Rx..."<<endl;
 #endif
-	/// Blocking receive from master process.
-	MPI_Recv(primeToMark,1, MPI_INT, 0, MARK_PRIME_TAG, MPI_COMM_WORLD,NULL);
-      
+	/// Wait for the batch posted last round.
+	PrimeTraceBegin();
+	MPI_Wait(&batchRequest[cur],MPI_STATUS_IGNORE);
+	PrimeTraceEnd(TRACE_RECV);
+	PrimeTraceReceived(primeBatchSize*sizeof(uint32_t));
+
+	/// Look for the exit flag; a batch without it is full and another
+	/// one follows, which is posted before this one is marked.
+	uint32_t batchCount=0;
+	while (batchCount<primeBatchSize && batch[cur][batchCount]!=PRIME_EXIT) batchCount++;
+	bool exitReceived=(batchCount<primeBatchSize);
+	PrimeTraceBegin();
+	if (!exitReceived)
+	  MPI_Ibcast(&batch[cur^1][0],primeBatchSize,MPI_UINT32_T,0,MPI_COMM_WORLD,&batchRequest[cur^1]);
+	PrimeTraceEnd(TRACE_RECV);
 #ifdef DEBUG
-	cout<<"R:"<<myRank<<" Received: "<<*primeToMark<<endl;
+	cout<<"R:"<<myRank<<" Received: "<<batchCount<<" primes"<<endl;
 #endif
-        /// Check to see if valid number or exit flag
-        if(*primeToMark==PRIME_EXIT){
+
+	/// Mark all multiples in the local block as non-primes.
+	PrimeTraceBegin();
+	MarkBatch(isPrimeArray,&batch[cur][0],batchCount);
+	PrimeTraceEnd(TRACE_MARK);
+
+        if(exitReceived){
 #ifdef DEBUG
 	  cout<<"R:"<<myRank<<"EXIT Received"<<endl;        
-	  for ( int i=baseIndex; i<baseUpperIndex; i++){    
-	    if (isPrimeArray[i-baseIndex]==true )
-	      cout<<"R:"<<myRank<<"\t"<<i<<" is Prime."<<endl;
-	  }
+	  WheelForEachPrime(isPrimeArray,localArrayLow,*localArraySize,highestNumber,
+			    [&](uint64_t p) { cout<<"R:"<<myRank<<"\t"<<p<<" is Prime."<<endl; });
 #endif     
 	  /// Exit while loop
 	  return;
 	}     
+	cur^=1;
 
-	/// Determine lowest and highest multiple of the primeToMark sent 
-	/// that is in our array.
-	if ( lowestIndex % (*primeToMark) !=0 ){
-	  lowestMultiple=(lowestIndex/(*primeToMark)+1)*(*primeToMark);
-	}else{
-	  lowestMultiple=lowestIndex;
-	} 
-
-	/// Trim up the lowestIndex as required until one that hasn't
-	/// already been marked is found
-	for ( int z=lowestIndex; z<highestIndex; z++){    
-	  if (isPrimeArray[z-baseIndex]==false ){
-	    lowestIndex++;
-#ifdef DEBUG
-	    cout<<"incrementing lowestIndex"<< lowestIndex;        
-	    cout<<" because isPrimeArray[i-lowestIndex]==false=="<<(int)isPrimeArray[z-baseIndex]<<endl;
-#endif
-	  } else { z=highestIndex;}
-	}
-       
-     
+      }//while(1)
+  }
+}//compute
 
-	/// Mark all multiples as non-primes    
-	for ( int i=lowestMultiple; i<highestIndex; i+=(*primeToMark)){
-	  /// If we just marked off the lowest index, reset the lowest index 
-	  isPrimeArray[i-baseIndex]=false;  
+/** \brief Fan-out mode with --shared: strikes the node's seed primes out
+ * of the local block.
+ * \param isPrimeArray wheel array for the numbers covered in the 
+ * local process
+ *
+ * Rank 0 sieves the seed primes once and broadcasts them among the node
+ * leaders, each into its node's window; that is the only message.  Every
+ * rank then strikes them out of its block with MarkBatch, primeBatchSize
+ * at a time, reading them where they are.
+ */
+void ComputePrimesNode(uint8_t isPrimeArray[])
+{
+  vector<uint32_t> seedPrimes;
+  const uint32_t *primes;
+  size_t count;
+  SeedPrimes(true,seedPrimes,&primes,&count);
+  /// WheelInit already struck out the primes up to WHEEL_PRESIEVE_MAX
+  size_t k=0;
+  while (k<count && primes[k]<=WHEEL_PRESIEVE_MAX) k++;
+  PrimeTraceBegin();
+  for ( ; k<count; k+=primeBatchSize)
+    MarkBatch(isPrimeArray,primes+k,(uint32_t)min((size_t)primeBatchSize,count-k));
+  PrimeTraceEnd(TRACE_MARK);
+}
+
+/** \brief Sieves the local block without any communication.
+ * \param localArraySize amount of wheel bytes covered by the local array.
+ * \param isPrimeArray wheel array for the numbers covered in the 
+ * local process
+ *
+ * \param lclCount if not null, receives the number of primes in the
+ * local block, counted window by window while each is still in cache
+ * \param lclStats if not null, receives the statistics of the primes in
+ * the local block, also gathered window by window
+ *
+ * The seed primes up to the square root of the highest number are few
+ * enough that every rank finds them itself.  The block is then initialized
+ * and struck out in cache-sized windows.
+ */
+void ComputePrimesLocal(uint64_t *localArraySize, uint8_t isPrimeArray[],
+			uint64_t *lclCount, PrimeStats *lclStats)
+{
+#ifdef DEBUG
+  cout<<"Rank:"<<myRank<<"\tComputing Primes Locally."<<endl;
+#endif     
+  /// Seed primes, including the root itself so its square is struck out
+  vector<uint32_t> seedPrimes;
+  const uint32_t *primes;
+  size_t numPrimes;
+  SeedPrimes(false,seedPrimes,&primes,&numPrimes);
+
+  /// Each thread sieves, counts and measures its own slice of the block.
+  PrimeTraceBegin();
+  vector<uint64_t> counts(threadPool->Size(),0);
+  vector<PrimeStats> slices(lclStats ? threadPool->Size() : 0);
+  threadPool->Run([&](int t) {
+      uint64_t low, n;
+      ThreadSlice(*localArraySize,threadPool->Size(),t,&low,&n);
+      WheelSieveWindows(isPrimeArray+low,localArrayLow+low,n,highestNumber,
+			primes,numPrimes,WHEEL_SEGMENT_BYTES,
+			[&](const uint8_t *window, uint64_t windowLow, uint32_t bytes) {
+			  if (lclCount) counts[t]+=WheelCount(window,bytes);
+			  if (lclStats)
+			    PrimeStatsAdd(slices[t],window,windowLow,bytes,lowestNumber,highestNumber);
+			});
+    });
+  PrimeTraceEnd(TRACE_MARK);
+  if (lclStats) {
+    *lclStats=PrimeStats();
+    for (size_t t=0; t<slices.size(); t++) PrimeStatsMerge(*lclStats,slices[t]);
+  }
+  if (lclCount) {
+    *lclCount=(localArrayLow==0) ? WheelUnstored(highestNumber)-WheelUnstored(lowestNumber) : 0;
+    for (size_t t=0; t<counts.size(); t++) *lclCount+=counts[t];
+  }
 #ifdef DEBUG
-	  cout<<"Setting "<<i<<" to false"<<endl;
+  WheelForEachPrime(isPrimeArray,localArrayLow,*localArraySize,highestNumber,
+		    [&](uint64_t p) { cout<<"R:"<<myRank<<"\t"<<p<<" is Prime."<<endl; });
 #endif
-         
-	}
-	/// Trim down the highest Index as required
-	for ( int i=(highestIndex-1); i>lowestIndex; i--){    
-	  if (isPrimeArray[i-baseIndex]==false ){ highestIndex--;} else { break;}
-	}
+}
 
-      }//while(1)
+
+/** \brief Sieves and counts one segment of the range with every thread.
+ * \param segment index of the segment, from the start of the range
+ * \param seedPrimes base primes up to the square root of the highest number
+ * \param numSeedPrimes number of them
+ * \param segmentArray buffer of segmentBytes wheel bytes
+ */
+uint64_t SieveDynamicSegment(uint64_t segment, const uint32_t *seedPrimes, size_t numSeedPrimes,
+			     uint8_t segmentArray[])
+{
+  uint64_t endByte=WheelBytes(highestNumber);
+  uint64_t segmentLow=lowestNumber/WHEEL_SPAN+segment*segmentBytes;
+  uint64_t n=min(segmentBytes,endByte-segmentLow);
+  vector<uint64_t> counts(threadPool->Size(),0);
+  threadPool->Run([&](int t) {
+      uint64_t low, tn;
+      ThreadSlice(n,threadPool->Size(),t,&low,&tn);
+      WheelSieveWindows(segmentArray+low,segmentLow+low,tn,highestNumber,
+			seedPrimes,numSeedPrimes,WHEEL_SEGMENT_BYTES,
+			[&](const uint8_t *window, uint64_t, uint32_t bytes) {
+			  counts[t]+=WheelCount(window,bytes);
+			});
+    });
+  uint64_t count=0;
+  for (size_t t=0; t<counts.size(); t++) count+=counts[t];
+  /// Only the first segment holds numbers below the range
+  return count-WheelClearBelow(segmentArray,segmentLow,n,lowestNumber);
+}
+
+/** \brief Sieves the range in segments handed out by rank 0 on request.
+ * \param myRank MPI rank of the local process within. 
+ * \param numProc MPI total number of proccesses.
+ * \param segmentArray buffer of segmentBytes wheel bytes
+ * \param lclCount receives the number of primes in the segments this
+ * rank sieved
+ * \param lclSegments receives the number of those segments
+ *
+ * Every rank finds the seed primes itself.  A worker asks rank 0 for its
+ * next segment before it starts on the current one, so the reply is on
+ * its way while it sieves.  Rank 0 answers all requests waiting and then
+ * sieves a segment itself, until none are left; each worker then gets
+ * SEGMENT_DONE in reply to its last request.
+ */
+void ComputePrimesDynamic(int myRank, int numProc, uint8_t segmentArray[],
+			  uint64_t *lclCount, uint64_t *lclSegments)
+{
+  vector<uint32_t> seedPrimes;
+  const uint32_t *primes;
+  size_t numPrimes;
+  SeedPrimes(false,seedPrimes,&primes,&numPrimes);
+
+  uint64_t rangeBytes=WheelBytes(highestNumber)-lowestNumber/WHEEL_SPAN;
+  uint64_t numSegments=(rangeBytes+segmentBytes-1)/segmentBytes;
+  *lclCount=(myRank==0) ? WheelUnstored(highestNumber)-WheelUnstored(lowestNumber) : 0;
+  *lclSegments=0;
+
+  if (myRank==0) {
+    /// Next segment to hand out, and workers not yet told to stop
+    uint64_t next=0;
+    int working=numProc-1;
+    while (next<numSegments || working>0) {
+      int waiting=0;
+      MPI_Status status;
+      /// Once all segments are out, only the workers' last requests remain
+      PrimeTraceBegin();
+      if (next<numSegments)
+	MPI_Iprobe(MPI_ANY_SOURCE,TAG_REQUEST,MPI_COMM_WORLD,&waiting,&status);
+      else {
+	MPI_Probe(MPI_ANY_SOURCE,TAG_REQUEST,MPI_COMM_WORLD,&status);
+	waiting=1;
+      }
+      PrimeTraceEnd(TRACE_RECV);
+      if (waiting) {
+	uint64_t reply=(next<numSegments) ? next++ : SEGMENT_DONE;
+	if (reply==SEGMENT_DONE) working--;
+	PrimeTraceBegin();
+	MPI_Recv(0,0,MPI_INT,status.MPI_SOURCE,TAG_REQUEST,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
+	PrimeTraceReceived(0);
+	MPI_Send(&reply,1,MPI_UINT64_T,status.MPI_SOURCE,TAG_SEGMENT,MPI_COMM_WORLD);
+	PrimeTraceEnd(TRACE_SEND);
+	PrimeTraceSent(sizeof(reply));
+	continue;
+      }
+      PrimeTraceBegin();
+      *lclCount+=SieveDynamicSegment(next++,primes,numPrimes,segmentArray);
+      PrimeTraceEnd(TRACE_MARK);
+      (*lclSegments)++;
+    }
+  }else{
+    /// Double buffered replies; the next one is asked for before the
+    /// current segment is sieved
+    uint64_t segment[2];
+    MPI_Request reply[2];
+    int cur=0;
+    PrimeTraceBegin();
+    MPI_Irecv(&segment[cur],1,MPI_UINT64_T,0,TAG_SEGMENT,MPI_COMM_WORLD,&reply[cur]);
+    MPI_Send(0,0,MPI_INT,0,TAG_REQUEST,MPI_COMM_WORLD);
+    PrimeTraceEnd(TRACE_SEND);
+    PrimeTraceSent(0);
+    while (1) {
+      PrimeTraceBegin();
+      MPI_Wait(&reply[cur],MPI_STATUS_IGNORE);
+      PrimeTraceEnd(TRACE_RECV);
+      PrimeTraceReceived(sizeof(segment[cur]));
+      if (segment[cur]==SEGMENT_DONE) break;
+      PrimeTraceBegin();
+      MPI_Irecv(&segment[cur^1],1,MPI_UINT64_T,0,TAG_SEGMENT,MPI_COMM_WORLD,&reply[cur^1]);
+      MPI_Send(0,0,MPI_INT,0,TAG_REQUEST,MPI_COMM_WORLD);
+      PrimeTraceEnd(TRACE_SEND);
+      PrimeTraceSent(0);
+      PrimeTraceBegin();
+      *lclCount+=SieveDynamicSegment(segment[cur],primes,numPrimes,segmentArray);
+      PrimeTraceEnd(TRACE_MARK);
+      (*lclSegments)++;
+      cur^=1;
+    }
   }
-}//compute
+}
 
 
 /**
@@ -288,8 +771,9 @@ int main( int argc, char *argv[])
   
   /// MPI communication type pointer
   MPI_Comm *mpiPrimeComm_t;
-  /// Initialize MPI environment
-  MPI_Init(&argc,&argv);
+  /// Initialize MPI environment; only this thread will make MPI calls
+  int threadSupport;
+  MPI_Init_thread(&argc,&argv,MPI_THREAD_FUNNELED,&threadSupport);
   /// Get total number of MPI proceesses
   MPI_Comm_size(MPI_COMM_WORLD,&numProc); 
 #ifdef DEBUG
@@ -300,36 +784,68 @@ int main( int argc, char *argv[])
 #ifdef DEBUG
   cout<<"Processes Rank: "<<myRank<<endl;
 #endif    
+  /// Per-rank stage timing, if PRIME_TRACE is set
+  PrimeTraceInit(MPI_COMM_WORLD);
 
 #ifdef DEBUG
   cout<<"MPI Comm Created"<<endl;
 #endif    
   /// Initialize local array size
-  localArraySize= new (nothrow) int;
+  localArraySize= new (nothrow) uint64_t;
   if (localArraySize==0) exit(1);
 
 
   
   /// Get matrix sizes
-  GetMaxNumber(argc,argv,&highestNumber);
+  GetMaxNumber(argc,argv,&highestNumber,&sieveMode,&primeBatchSize,&segmentBytes,&numThreads,
+	       &countPrimes,&outputPath,&outputFormat,&lowestNumber,&primeStats,&nodeShared);
+  if (threadSupport<MPI_THREAD_FUNNELED && numThreads>1) {
+    if (myRank==0)
+      cout<<"Warning: MPI library lacks MPI_THREAD_FUNNELED, using 1 thread"<<endl;
+    numThreads=1;
+  }
+  threadPool=new ThreadPool(numThreads);
+  if (nodeShared) PrimeNodeInit(primeNode,MPI_COMM_WORLD);
 
   /// Determine square root
-  rootHighestNumber=sqrt(highestNumber);
+  rootHighestNumber=WheelSqrt(highestNumber);
 #ifdef DEBUG
   cout<<"Rank:"<<myRank<<"\tRoot of Highest Number: "<<rootHighestNumber<<endl;
 #endif  
-  /// Determine the local group size
-  if (myRank<(highestNumber%numProc)) {
-    *localArraySize=(highestNumber/numProc)+1;
+  /// Determine the local group size. The wheel bytes covering
+  /// [lowestNumber, highestNumber) are split as evenly as possible.
+  uint64_t lowestByte=lowestNumber/WHEEL_SPAN;
+  uint64_t totalBytes=WheelBytes(highestNumber)-lowestByte;
+  if ((uint64_t)myRank<totalBytes%numProc) {
+    *localArraySize=(totalBytes/numProc)+1;
+    localArrayLow=lowestByte+myRank*(*localArraySize);
   }else{ 
-    *localArraySize=(highestNumber/numProc);
+    *localArraySize=(totalBytes/numProc);
+    localArrayLow=lowestByte+myRank*(*localArraySize)+totalBytes%numProc;
+  }
+  /// In dynamic mode a rank holds no block of its own, only the segment
+  /// it is sieving
+  uint64_t arrayBytes=*localArraySize;
+  if (sieveMode==MODE_DYNAMIC) {
+    *localArraySize=0;
+    localArrayLow=lowestByte;
+    arrayBytes=min(segmentBytes,totalBytes);
   }
 #ifdef DEBUG
   cout<<"Rank:"<<myRank<<"\tLocal Array Size:"<<*localArraySize<<endl;
 #endif    
   
-  /// Allocate the local prime array
-  lclIsPrimeArray = new (nothrow) bool[*localArraySize];
+  /// Allocate the local prime array, in huge pages where possible, or
+  /// with --shared as this rank's part of the node's window; no page is
+  /// placed until a thread first writes it
+  PrimeTraceBegin();
+  if (nodeShared) {
+    lclIsPrimeArray = PrimeNodeAlloc(primeNode,arrayBytes,blockWindow) ? blockWindow.data : 0;
+    lclMemory.data = lclIsPrimeArray;
+    lclMemory.bytes = arrayBytes;
+  }
+  else
+    lclIsPrimeArray = PrimeMemoryAlloc(lclMemory,arrayBytes) ? lclMemory.data : 0;
   /// Test for correct allocation
   if(lclIsPrimeArray==0) {
     cout <<"Rank:"<<myRank<<"\tERROR:  Insufficient Memory" << endl;
@@ -338,9 +854,12 @@ int main( int argc, char *argv[])
 #ifdef DEBUG
   cout<<"Rank:"<<myRank<<"\tlclIsPrimeArray @ : 0x"<<hex<<lclIsPrimeArray<<dec<<endl;
 #endif        
-  /// Initialize isPrimeArray to true, all non-primes
-  /// will be marked false.
-  for ( int i=0;i<*localArraySize;i++) lclIsPrimeArray[i]=true;
+  /// Initialize isPrimeArray to all candidates, all non-primes
+  /// will be cleared. The local and dynamic modes initialize each window
+  /// on the thread that sieves it instead.
+  if (sieveMode==MODE_FANOUT)
+    InitLocalArray(lclIsPrimeArray);
+  PrimeTraceEnd(TRACE_INIT);
 #ifdef DEBUG
   cout<<"Rank:"<<myRank<<"\tLocal Prime Array Initialized."<<endl;
 #endif         
@@ -358,22 +877,106 @@ int main( int argc, char *argv[])
    *above it. 
    */
   
+  /// Elapsed time in microseconds; in local mode the slowest rank's
+  double elapsed;
+  /// Primes in the local block and, on rank 0, in all blocks
+  uint64_t lclCount=0, totalCount=0;
+  /// Statistics of the local block and, on rank 0, of the whole range
+  PrimeStats lclStats, totalStats;
   TIMER_CLEAR;    
   TIMER_START;
-  /// Call function on all processes to seive through the primes.
-  ComputePrimes(myRank,numProc,localArraySize, lclIsPrimeArray);
-  MPI_Barrier(MPI_COMM_WORLD);
+  if (sieveMode==MODE_LOCAL) {
+    /// Every rank sieves alone; the only communication is the final
+    /// reduction of the per-rank times.
+    ComputePrimesLocal(localArraySize,lclIsPrimeArray,countPrimes ? &lclCount : 0,
+		       primeStats ? &lclStats : 0);
+    /// The first byte of the range also holds numbers below it
+    uint64_t cleared=WheelClearBelow(lclIsPrimeArray,localArrayLow,*localArraySize,lowestNumber);
+    if (countPrimes) lclCount-=cleared;
+    TIMER_STOP;
+    double lclElapsed=TIMER_ELAPSED;
+    PrimeTraceBegin();
+    MPI_Reduce(&lclElapsed,&elapsed,1,MPI_DOUBLE,MPI_MAX,0,MPI_COMM_WORLD);
+    PrimeTraceEnd(TRACE_GATHER);
+  }else if (sieveMode==MODE_DYNAMIC) {
+    /// Segments sieved by each rank, to show how the work was shared
+    uint64_t lclSegments;
+    ComputePrimesDynamic(myRank,numProc,lclIsPrimeArray,&lclCount,&lclSegments);
+    TIMER_STOP;
+    double lclElapsed=TIMER_ELAPSED;
+    PrimeTraceBegin();
+    MPI_Reduce(&lclElapsed,&elapsed,1,MPI_DOUBLE,MPI_MAX,0,MPI_COMM_WORLD);
+    vector<uint64_t> shares(numProc);
+    MPI_Gather(&lclSegments,1,MPI_UINT64_T,&shares[0],1,MPI_UINT64_T,0,MPI_COMM_WORLD);
+    PrimeTraceEnd(TRACE_GATHER);
+    if (myRank==0) {
+      cout << "segments=";
+      for (int r=0; r<numProc; r++) cout << (r ? "," : "") << shares[r];
+      cout << endl;
+    }
+  }else{
+    /// Call function on all processes to seive through the primes.
+    if (nodeShared) ComputePrimesNode(lclIsPrimeArray);
+    else ComputePrimes(myRank, lclIsPrimeArray);
+    WheelClearBelow(lclIsPrimeArray,localArrayLow,*localArraySize,lowestNumber);
+    PrimeTraceBegin();
+    if (countPrimes) lclCount=CountLocalPrimes(lclIsPrimeArray);
+    if (primeStats) LocalStats(lclIsPrimeArray,&lclStats);
+    PrimeTraceEnd(TRACE_GATHER);
+    PrimeTraceBegin();
+    MPI_Barrier(MPI_COMM_WORLD);
+    PrimeTraceEnd(TRACE_IDLE);
   
-  TIMER_STOP;  
+    TIMER_STOP;  
+    elapsed=TIMER_ELAPSED;
+  }
+  PrimeTraceBegin();
+  if (countPrimes)
+    MPI_Reduce(&lclCount,&totalCount,1,MPI_UINT64_T,MPI_SUM,0,MPI_COMM_WORLD);
+  /// Blocks are in rank order, so the statistics can be merged in it
+  if (primeStats)
+    PrimeStatsReduce(lclStats,totalStats,MPI_COMM_WORLD);
+  PrimeTraceEnd(TRACE_GATHER);
+  PrimeTraceStop();
+  PrimeTraceMemory([](char *text, size_t size) { PrimeMemoryPlacement(lclMemory,text,size); });
 
 #ifdef PRINT_PRIMES
-  /// Print primes
-  for ( int i=1;i<highestNumber;i++) 
-    if (isPrimeArray[i]==true)cout<<i<<endl;
+  /// Print primes, one rank after the other; dynamic mode keeps none
+  for (int r=0; r<numProc; r++) {
+    if (r==myRank && *localArraySize>0)
+      WheelForEachPrime(lclIsPrimeArray,localArrayLow,*localArraySize,highestNumber,
+			[](uint64_t p) { if (p>=lowestNumber) cout<<p<<"\n"; });
+    cout<<flush;
+    MPI_Barrier(MPI_COMM_WORLD);
+  }
 #endif
  
+  if (myRank==0 && countPrimes)
+    cout << "primes=" << totalCount << endl;
+  if (myRank==0 && primeStats)
+    PrimeStatsPrint(totalStats,cout);
   if (myRank==0)
-    cout << "time=" << setprecision(8) <<  TIMER_ELAPSED/1000000.0  << " seconds" << endl;
+    cout << "time=" << setprecision(8) <<  elapsed/1000000.0  << " seconds" << endl;
+  PrimeTraceReport(MPI_COMM_WORLD);
+
+  /// Write the primes, each rank its own block, and time that separately
+  if (outputPath) {
+    TIMER_CLEAR;
+    TIMER_START;
+    PrimeFileWrite(outputPath,outputFormat,lclIsPrimeArray,localArrayLow,*localArraySize,
+		   highestNumber,MPI_COMM_WORLD,lowestNumber);
+    TIMER_STOP;
+    if (myRank==0)
+      cout << "write=" << setprecision(8) <<  TIMER_ELAPSED/1000000.0  << " seconds" << endl;
+  }
+  if (nodeShared) {
+    PrimeNodeRelease(blockWindow);
+    PrimeNodeRelease(seedWindow);
+    PrimeNodeFree(primeNode);
+  }
+  else
+    PrimeMemoryFree(lclMemory);
+  delete threadPool;
   /// Terminate MPI communications
   MPI_Finalize();
 }
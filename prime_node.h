@@ -0,0 +1,188 @@
+//MIT License
+
+//Copyright (c) 2016 Ashton Johnson
+
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+
+/******************************************************************/
+/**
+* Memory shared by the ranks of one node
+* @file prime_node.h
+* @author Ashton Johnson, Paul Henny
+* @brief Splits the ranks by node and keeps node-wide data in MPI shared
+* memory windows instead of copying it rank to rank.
+*
+* PrimeNodeInit splits a communicator with MPI_Comm_split_type
+* (MPI_COMM_TYPE_SHARED).  Rank 0 of each node is its leader, and the
+* leaders get a communicator of their own, so data that has to cross
+* nodes goes to one rank per node only.
+*
+* A PrimeNodeWindow comes from MPI_Win_allocate_shared.  Every rank of the
+* node can load and store every other rank's part directly.  The parts are
+* allocated non-contiguously, so each can sit on the NUMA node of the rank
+* that first touches it.  A window stays in a passive epoch (lock_all)
+* for its whole life.  PrimeNodeSync is the fence between stores of one
+* rank and loads of another.
+*
+* PrimeNodeBasePrimes builds one table of base primes per node.  Either
+* the leader of every node sieves it, or world rank 0 sieves it and
+* broadcasts it to the other leaders.
+*/
+#ifndef PRIME_NODE_H
+#define PRIME_NODE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <mpi.h>
+#include "prime_sieve.h"
+
+/// The ranks of one node.
+struct PrimeNode {
+  /// every rank of this node, in world order
+  MPI_Comm comm;
+  int rank, size;
+  /// the leader of every node; MPI_COMM_NULL on the other ranks
+  MPI_Comm leaders;
+  /// world rank of every rank of this node, by node rank
+  std::vector<int> worldRanks;
+
+  PrimeNode() : comm(MPI_COMM_NULL), rank(0), size(1), leaders(MPI_COMM_NULL) {}
+};
+
+/// A window of memory shared by the ranks of a node.
+struct PrimeNodeWindow {
+  MPI_Win win;
+  /// this rank's part of the window
+  uint8_t *data;
+  uint64_t bytes;
+
+  PrimeNodeWindow() : win(MPI_WIN_NULL), data(0), bytes(0) {}
+};
+
+/** \brief Splits comm into nodes and their leaders; collective over comm. */
+static inline void PrimeNodeInit(PrimeNode &node, MPI_Comm comm)
+{
+  int worldRank;
+  MPI_Comm_rank(comm, &worldRank);
+  MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, worldRank, MPI_INFO_NULL, &node.comm);
+  MPI_Comm_rank(node.comm, &node.rank);
+  MPI_Comm_size(node.comm, &node.size);
+  MPI_Comm_split(comm, node.rank == 0 ? 0 : MPI_UNDEFINED, worldRank, &node.leaders);
+  node.worldRanks.resize(node.size);
+  MPI_Allgather(&worldRank, 1, MPI_INT, &node.worldRanks[0], 1, MPI_INT, node.comm);
+}
+
+/** \brief Frees the communicators of PrimeNodeInit. */
+static inline void PrimeNodeFree(PrimeNode &node)
+{
+  if (node.leaders != MPI_COMM_NULL) MPI_Comm_free(&node.leaders);
+  if (node.comm != MPI_COMM_NULL) MPI_Comm_free(&node.comm);
+}
+
+/** \brief Allocates this rank's part of a window, bytes bytes; collective
+ * over the node.
+ * \return false if MPI could not allocate it
+ *
+ * The contents are undefined until the owner initializes them.
+ */
+static inline bool PrimeNodeAlloc(const PrimeNode &node, uint64_t bytes, PrimeNodeWindow &w)
+{
+  MPI_Info info;
+  MPI_Info_create(&info);
+  MPI_Info_set(info, (char *)"alloc_shared_noncontig", (char *)"true");
+  w = PrimeNodeWindow();
+  w.bytes = bytes;
+  int rc = MPI_Win_allocate_shared((MPI_Aint)bytes, 1, info, node.comm, &w.data, &w.win);
+  MPI_Info_free(&info);
+  if (rc != MPI_SUCCESS) return false;
+  MPI_Win_lock_all(MPI_MODE_NOCHECK, w.win);
+  return true;
+}
+
+/** \brief Address of the part of node rank r; its size goes to bytes. */
+static inline uint8_t *PrimeNodePart(const PrimeNodeWindow &w, int r, uint64_t *bytes)
+{
+  MPI_Aint size;
+  int unit;
+  uint8_t *part;
+  MPI_Win_shared_query(w.win, r, &size, &unit, &part);
+  if (bytes) *bytes = (uint64_t)size;
+  return part;
+}
+
+/** \brief Makes every store to the window so far visible to every rank of
+ * the node; collective over the node.
+ */
+static inline void PrimeNodeSync(const PrimeNode &node, const PrimeNodeWindow &w)
+{
+  MPI_Win_sync(w.win);
+  MPI_Barrier(node.comm);
+  MPI_Win_sync(w.win);
+}
+
+/** \brief Frees a window; collective over the node. */
+static inline void PrimeNodeRelease(PrimeNodeWindow &w)
+{
+  if (w.win == MPI_WIN_NULL) return;
+  MPI_Win_unlock_all(w.win);
+  MPI_Win_free(&w.win);
+  w = PrimeNodeWindow();
+}
+
+/** \brief Builds one table of the primes below limit per node.
+ * \param broadcast if true, world rank 0 sieves the table and sends it to
+ * the other leaders; otherwise every leader sieves its own
+ * \param primes receives the table, in w; count receives its length
+ * \return false if MPI could not allocate this rank's part of w
+ *
+ * Collective over the node, and over the leaders when broadcasting.  Only
+ * the leader's part of w holds anything: the length, then the primes.
+ * The other ranks read it in place.  MPI may round a part up, so the
+ * length is stored rather than taken from the size of the part.
+ */
+static inline bool PrimeNodeBasePrimes(const PrimeNode &node, uint32_t limit, bool broadcast,
+                                       PrimeNodeWindow &w, const uint32_t **primes, size_t *count)
+{
+  std::vector<uint32_t> table;
+  uint64_t n = 0;
+  if (node.rank == 0) {
+    int leader = 0;
+    if (broadcast) MPI_Comm_rank(node.leaders, &leader);
+    if (leader == 0) WheelBasePrimes(limit, table);
+    n = table.size();
+    if (broadcast) MPI_Bcast(&n, 1, MPI_UINT64_T, 0, node.leaders);
+  }
+  if (!PrimeNodeAlloc(node, node.rank == 0 ? sizeof(uint64_t) + n * sizeof(uint32_t) : 0, w))
+    return false;
+  if (node.rank == 0) {
+    memcpy(w.data, &n, sizeof(uint64_t));
+    uint32_t *to = (uint32_t *)(w.data + sizeof(uint64_t));
+    if (!table.empty()) memcpy(to, &table[0], n * sizeof(uint32_t));
+    if (broadcast && n > 0) MPI_Bcast(to, (int)n, MPI_UINT32_T, 0, node.leaders);
+  }
+  PrimeNodeSync(node, w);
+  const uint8_t *part = PrimeNodePart(w, 0, 0);
+  memcpy(&n, part, sizeof(uint64_t));
+  *primes = (const uint32_t *)(part + sizeof(uint64_t));
+  *count = n;
+  return true;
+}
+
+#endif /* PRIME_NODE_H */
@@ -0,0 +1,542 @@
+/******************************************************************/
+/* Prime number generation program              -- query server */
+/*Copyright 2016 Ashton Johnson, Paul Henny */
+/******************************************************************/
+// compilation:
+//   gnu compiler
+//      g++ prime_server.cpp -o prime_server -O3 -lm -pthread
+/*
+  Long-lived server that answers small questions about primes without
+  sieving from zero every time.  It keeps the base primes, the count
+  checkpoints and the most recently used sieved segments in memory (see
+  prime_cache.h), and serves batches of queries over a Unix socket:
+
+    prime_server [-t threads] [-c cacheMiB] [-m maxNumber] --serve <socket>
+    prime_server --query <socket>
+
+  --serve runs the server on the socket path until SIGINT or SIGTERM.
+  Numbers from maxNumber on (default SERVER_MAX_NUMBER) are refused, so
+  one query cannot start a sieve of hours.  -c sets the memory for
+  cached segments (default SERVER_CACHE_MIB), and -t the sieving threads.
+
+  --query reads one query per line from stdin, sends them in batches of
+  up to SERVER_MAX_BATCH and prints one line per answer:
+    pi x          primes up to and including x      pi(x)=n
+    next x        smallest prime above x            next(x)=p
+    nth n         n-th prime, 2 being the first     nth(n)=p
+    range a b     primes in [a, b]                  range(a,b)=n, then the primes
+    isprime x     any 64-bit x, by Miller-Rabin     isprime(x)=0|1
+  A range lists at most SERVER_MAX_LIST primes, and all the ranges of one
+  batch at most SERVER_MAX_REPLY between them; n is always the full count.
+
+  Protocol, host byte order, as client and server share a machine: a
+  request is a server_header with magic SERVER_QUERY and count queries,
+  followed by count server_query records.  The reply is a server_header
+  with magic SERVER_REPLY and the same count, then one server_reply per
+  query, each followed by its listed primes as uint64_t.  A connection
+  may carry any number of requests.
+
+  Before answering a batch the server sieves every segment it will need
+  that is not cached, all at once on its threads: first the checkpoints
+  up to the highest count asked for, then the segments holding the other
+  answers.  A batch that only touches cached segments is answered with
+  table lookups and popcounts.
+*/
+
+using namespace std;
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <vector>
+#include "prime_driver.h"
+#include "prime_sieve.h"
+#include "prime_threads.h"
+#include "prime_test.h"
+#include "prime_cache.h"
+
+#define SERVER_QUERY 0x51524d50u      /* "PMRQ" read as a little-endian word */
+#define SERVER_REPLY 0x52524d50u      /* "PMRR" */
+#define SERVER_MAX_BATCH 65536        /* queries per request */
+#define SERVER_MAX_LIST (1u<<20)      /* primes listed per range query */
+#define SERVER_MAX_REPLY (1u<<22)     /* primes listed per request, 32 MiB */
+#define SERVER_MAX_NUMBER 1000000000000ull /* default of -m */
+#define SERVER_CACHE_MIB 256          /* default of -c */
+#define SERVER_MAX_CLIENTS 64         /* connections served at once */
+
+/* kinds of query */
+enum query_kind { QUERY_PI=1, QUERY_NEXT=2, QUERY_NTH=3, QUERY_RANGE=4, QUERY_IS_PRIME=5 };
+
+/* status of an answer */
+enum query_status {
+  STATUS_OK=0,
+  STATUS_RANGE=1,     /* the answer would need numbers from maxNumber on */
+  STATUS_BAD=2        /* unknown kind, or a range with a > b */
+};
+
+/* start of every request and reply */
+struct server_header {
+  uint32_t magic;
+  uint32_t count;
+};
+
+/* one query; b is only used by ranges */
+struct server_query {
+  uint32_t kind;
+  uint32_t unused;
+  uint64_t a, b;
+};
+
+/* one answer; count primes follow it, for ranges only */
+struct server_reply {
+  uint32_t status;
+  uint32_t unused;
+  uint64_t value;
+  uint64_t count;
+};
+
+/* set by SIGINT and SIGTERM */
+static volatile sig_atomic_t stopping=0;
+
+void stop_server(int)
+{
+  stopping=1;
+}
+
+/*
+  Routines the client uses to move a whole buffer through its blocking
+  socket, however the kernel splits it; false once the other end is gone.
+*/
+bool read_full(int fd,void *buffer,size_t bytes)
+{
+  uint8_t *at=(uint8_t *)buffer;
+  while (bytes>0) {
+    ssize_t n=read(fd,at,bytes);
+    if (n<0 && errno==EINTR) continue;
+    if (n<=0) return false;
+    at+=n;
+    bytes-=n;
+  }
+  return true;
+}
+
+bool write_full(int fd,const void *buffer,size_t bytes)
+{
+  const uint8_t *at=(const uint8_t *)buffer;
+  while (bytes>0) {
+    ssize_t n=write(fd,at,bytes);
+    if (n<0 && errno==EINTR) continue;
+    if (n<=0) return false;
+    at+=n;
+    bytes-=n;
+  }
+  return true;
+}
+
+/*
+  Routine that fills in the address of a socket path; false if the path
+  is too long.
+*/
+bool socket_address(const char *path,struct sockaddr_un *address)
+{
+  memset(address,0,sizeof(*address));
+  address->sun_family=AF_UNIX;
+  if (strlen(path)>=sizeof(address->sun_path)) return false;
+  strcpy(address->sun_path,path);
+  return true;
+}
+
+/*
+  Routine that sieves, in parallel, whatever a batch needs and is not in
+  the cache: the checkpoints up to the highest pi asked for, then the
+  segments that hold the rest of the answers, as many as the cache holds.
+*/
+void prefetch(PrimeCache &cache,const vector<server_query> &queries)
+{
+  uint64_t counted=0;
+  bool counting=false;
+  vector<uint64_t> segments;
+  for (size_t i=0; i<queries.size(); i++) {
+    const server_query &q=queries[i];
+    if (q.a>=cache.maxNumber || (q.kind==QUERY_RANGE && (q.b>=cache.maxNumber || q.a>q.b)))
+      continue;
+    if (q.kind==QUERY_PI || q.kind==QUERY_RANGE) {
+      uint64_t top=PrimeCacheSegmentOf(q.kind==QUERY_PI ? q.a+1 : q.b+1);
+      counted=max(counted,top);
+      counting=true;
+    }
+    if (q.kind==QUERY_PI || q.kind==QUERY_NEXT) segments.push_back(PrimeCacheSegmentOf(q.a+1));
+    if (q.kind==QUERY_RANGE)
+      for (uint64_t s=PrimeCacheSegmentOf(q.a); s<=PrimeCacheSegmentOf(q.b) &&
+             segments.size()<cache.capacity; s++)
+        segments.push_back(s);
+  }
+  if (counting) PrimeCacheCountTo(cache,counted);
+  sort(segments.begin(),segments.end());
+  segments.erase(unique(segments.begin(),segments.end()),segments.end());
+  if (segments.size()>cache.capacity) segments.resize(cache.capacity);
+  if (!segments.empty()) PrimeCacheSieve(cache,segments,0);
+}
+
+/*
+  Routine that answers one query; the primes of a range are appended to
+  listed, at most room of them.
+*/
+server_reply answer(PrimeCache &cache,const server_query &q,vector<uint64_t> &listed,
+                    uint64_t room)
+{
+  server_reply r;
+  memset(&r,0,sizeof(r));
+  r.status=STATUS_OK;
+  switch (q.kind) {
+  case QUERY_PI:
+    if (q.a>=cache.maxNumber) r.status=STATUS_RANGE;
+    else r.value=PrimeCachePi(cache,q.a);
+    break;
+  case QUERY_NEXT:
+    if (q.a>=cache.maxNumber || !PrimeCacheNext(cache,q.a,&r.value)) r.status=STATUS_RANGE;
+    break;
+  case QUERY_NTH:
+    if (!PrimeCacheNth(cache,q.a,&r.value)) r.status=q.a==0 ? STATUS_BAD : STATUS_RANGE;
+    break;
+  case QUERY_RANGE:
+    if (q.a>q.b) r.status=STATUS_BAD;
+    else if (q.b>=cache.maxNumber) r.status=STATUS_RANGE;
+    else {
+      r.value=PrimeCachePi(cache,q.b)-(q.a>0 ? PrimeCachePi(cache,q.a-1) : 0);
+      if (room>0)
+        PrimeCacheRange(cache,q.a,q.b,[&](uint64_t p) {
+          listed.push_back(p);
+          return ++r.count<room;
+        });
+    }
+    break;
+  case QUERY_IS_PRIME:
+    r.value=PrimeTestIsPrime(q.a);
+    break;
+  default:
+    r.status=STATUS_BAD;
+  }
+  return r;
+}
+
+/* a connected client; requests and replies move without blocking */
+struct server_client {
+  int fd;
+  vector<uint8_t> in;   /* the request read so far */
+  vector<uint8_t> out;  /* the reply not yet written */
+  size_t sent;
+};
+
+/*
+  Routine that answers a whole request, queries in order, into the
+  client's reply.  A range lists no more primes than the request has
+  room left for, so a reply holds at most SERVER_MAX_REPLY primes.
+*/
+void serve_request(PrimeCache &cache,server_client &client,uint64_t *served)
+{
+  server_header header;
+  memcpy(&header,&client.in[0],sizeof(header));
+  vector<server_query> queries(header.count);
+  if (header.count>0)
+    memcpy(&queries[0],&client.in[sizeof(header)],header.count*sizeof(server_query));
+
+  prefetch(cache,queries);
+  // each reply is followed by its primes
+  vector<uint8_t> &out=client.out;
+  vector<uint64_t> listed;
+  uint64_t room=SERVER_MAX_REPLY;
+  out.resize(sizeof(header));
+  header.magic=SERVER_REPLY;
+  memcpy(&out[0],&header,sizeof(header));
+  for (size_t i=0; i<queries.size(); i++) {
+    listed.clear();
+    server_reply r=answer(cache,queries[i],listed,min(room,(uint64_t)SERVER_MAX_LIST));
+    room-=listed.size();
+    size_t at=out.size();
+    out.resize(at+sizeof(r)+listed.size()*sizeof(uint64_t));
+    memcpy(&out[at],&r,sizeof(r));
+    if (!listed.empty())
+      memcpy(&out[at+sizeof(r)],&listed[0],listed.size()*sizeof(uint64_t));
+  }
+  client.sent=0;
+  *served+=queries.size();
+}
+
+/*
+  Routine that reads what a client has sent, at most up to the end of
+  its request, and serves the request once it is whole.  False if the
+  client is gone or broke the protocol, and the connection is to be
+  closed.
+*/
+bool client_read(PrimeCache &cache,server_client &client,uint64_t *served)
+{
+  server_header header;
+  for (;;) {
+    size_t need=sizeof(header);
+    if (client.in.size()>=sizeof(header)) {
+      memcpy(&header,&client.in[0],sizeof(header));
+      if (header.magic!=SERVER_QUERY || header.count>SERVER_MAX_BATCH) return false;
+      need+=header.count*sizeof(server_query);
+      if (client.in.size()==need) break;
+    }
+    size_t at=client.in.size();
+    client.in.resize(need);
+    ssize_t n=read(client.fd,&client.in[at],need-at);
+    client.in.resize(at+(n>0 ? n : 0));
+    if (n<0 && errno==EINTR) continue;
+    if (n<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) return true;
+    if (n<=0) return false;
+  }
+  serve_request(cache,client,served);
+  client.in.clear();
+  return true;
+}
+
+/*
+  Routine that writes as much of a client's reply as the socket takes;
+  false if the client is gone.
+*/
+bool client_write(server_client &client)
+{
+  while (client.sent<client.out.size()) {
+    ssize_t n=write(client.fd,&client.out[client.sent],client.out.size()-client.sent);
+    if (n<0 && errno==EINTR) continue;
+    if (n<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) return true;
+    if (n<=0) return false;
+    client.sent+=n;
+  }
+  client.out.clear();
+  return true;
+}
+
+/*
+  Routine that runs the server on a Unix socket until it is stopped.
+  Clients are served one request at a time, in the order poll reports
+  them; the parallelism is in the sieving.  No socket ever blocks the
+  server: a request is answered once all of it has arrived, and a client
+  reads no further requests until its reply is written.
+*/
+void serve(const char *path,int threads,uint64_t cacheMiB,uint64_t maxNumber)
+{
+  struct sockaddr_un address;
+  if (!socket_address(path,&address)) {
+    cout<<"Error: socket path too long: "<<path<<endl;
+    exit(1);
+  }
+  int listener=socket(AF_UNIX,SOCK_STREAM,0);
+  // a socket left behind by an earlier server is replaced
+  unlink(path);
+  if (listener<0 || bind(listener,(struct sockaddr *)&address,sizeof(address))!=0
+      || listen(listener,SERVER_MAX_CLIENTS)!=0) {
+    cout<<"ERROR:  Cannot listen on "<<path<<": "<<strerror(errno)<<endl;
+    exit(1);
+  }
+  signal(SIGPIPE,SIG_IGN);
+  struct sigaction action;
+  memset(&action,0,sizeof(action));
+  action.sa_handler=stop_server;
+  sigaction(SIGINT,&action,0);
+  sigaction(SIGTERM,&action,0);
+
+  ThreadPool pool(threads);
+  PrimeCache cache;
+  PrimeCacheInit(cache,cacheMiB*(1u<<20)/PRIME_CACHE_SEGMENT,maxNumber,&pool);
+  cout<<"serving "<<path<<" below "<<maxNumber<<", "<<cache.capacity<<" segments of "
+      <<PRIME_CACHE_SEGMENT*WHEEL_SPAN<<" numbers"<<endl;
+
+  // fds[0] is the listener, fds[i+1] belongs to clients[i]
+  vector<struct pollfd> fds(1);
+  vector<server_client> clients;
+  fds[0].fd=listener;
+  uint64_t served=0;
+  while (!stopping) {
+    // a full table leaves new connections waiting in the backlog
+    fds[0].events=clients.size()<SERVER_MAX_CLIENTS ? POLLIN : 0;
+    for (size_t i=0; i<clients.size(); i++)
+      fds[i+1].events=clients[i].out.empty() ? POLLIN : POLLOUT;
+    if (poll(&fds[0],fds.size(),-1)<0) {
+      if (errno==EINTR) continue;
+      break;
+    }
+    for (size_t i=clients.size(); i-->0; ) {
+      short revents=fds[i+1].revents;
+      if (revents==0) continue;
+      bool open;
+      if (revents&POLLOUT) open=client_write(clients[i]);
+      else if (revents&POLLIN) {
+        open=client_read(cache,clients[i],&served);
+        // most replies fit the socket buffer at once
+        if (open && !clients[i].out.empty()) open=client_write(clients[i]);
+      }
+      else open=false;
+      if (!open) {
+        close(clients[i].fd);
+        clients.erase(clients.begin()+i);
+        fds.erase(fds.begin()+i+1);
+      }
+    }
+    if (fds[0].revents&POLLIN) {
+      int fd=accept(listener,0,0);
+      if (fd>=0) {
+        fcntl(fd,F_SETFL,fcntl(fd,F_GETFL)|O_NONBLOCK);
+        server_client client;
+        client.fd=fd;
+        client.sent=0;
+        clients.push_back(client);
+        struct pollfd poller;
+        poller.fd=fd;
+        poller.events=POLLIN;
+        poller.revents=0;
+        fds.push_back(poller);
+      }
+    }
+  }
+  for (size_t i=0; i<fds.size(); i++) close(fds[i].fd);
+  unlink(path);
+  cout<<"queries="<<served<<" sieved="<<cache.sieved<<" hits="<<cache.hits
+      <<" counted="<<(cache.before.size()-1)*PRIME_CACHE_SEGMENT*WHEEL_SPAN<<endl;
+}
+
+/*
+  Routine that parses one query line; false if it is not a query.
+*/
+bool parse_query(const string &line,server_query *q)
+{
+  istringstream in(line);
+  string kind, a, b, rest;
+  in>>kind>>a;
+  memset(q,0,sizeof(*q));
+  if (kind=="pi") q->kind=QUERY_PI;
+  else if (kind=="next") q->kind=QUERY_NEXT;
+  else if (kind=="nth") q->kind=QUERY_NTH;
+  else if (kind=="isprime") q->kind=QUERY_IS_PRIME;
+  else if (kind=="range") q->kind=QUERY_RANGE;
+  else return false;
+  if (q->kind==QUERY_RANGE && !(in>>b && PrimeParseNumber(b.c_str(),&q->b))) return false;
+  return PrimeParseNumber(a.c_str(),&q->a) && !(in>>rest);
+}
+
+/*
+  Routine that sends a batch of queries, reads the answers and prints them.
+*/
+void run_batch(int fd,const vector<server_query> &queries)
+{
+  static const char *NAMES[6]={"","pi","next","nth","range","isprime"};
+  static const char *ERRORS[3]={"","error out of range","error bad query"};
+  server_header header;
+  header.magic=SERVER_QUERY;
+  header.count=queries.size();
+  if (!write_full(fd,&header,sizeof(header))
+      || !write_full(fd,&queries[0],queries.size()*sizeof(server_query))
+      || !read_full(fd,&header,sizeof(header)) || header.magic!=SERVER_REPLY) {
+    cout<<"ERROR:  Lost the server"<<endl;
+    exit(1);
+  }
+  vector<uint64_t> listed;
+  for (size_t i=0; i<queries.size(); i++) {
+    const server_query &q=queries[i];
+    server_reply r;
+    if (!read_full(fd,&r,sizeof(r))) {
+      cout<<"ERROR:  Lost the server"<<endl;
+      exit(1);
+    }
+    listed.resize(r.count);
+    if (r.count>0 && !read_full(fd,&listed[0],r.count*sizeof(uint64_t))) {
+      cout<<"ERROR:  Lost the server"<<endl;
+      exit(1);
+    }
+    cout<<NAMES[q.kind]<<"("<<q.a;
+    if (q.kind==QUERY_RANGE) cout<<","<<q.b;
+    cout<<")=";
+    if (r.status!=STATUS_OK) cout<<ERRORS[r.status<3 ? r.status : 2]<<"\n";
+    else cout<<r.value<<"\n";
+    for (size_t k=0; k<listed.size(); k++) cout<<listed[k]<<"\n";
+  }
+}
+
+/*
+  Routine that reads queries from stdin and has the server answer them,
+  SERVER_MAX_BATCH per request.
+*/
+void query(const char *path)
+{
+  struct sockaddr_un address;
+  int fd=socket(AF_UNIX,SOCK_STREAM,0);
+  if (!socket_address(path,&address) || fd<0
+      || connect(fd,(struct sockaddr *)&address,sizeof(address))!=0) {
+    cout<<"ERROR:  Cannot connect to "<<path<<": "<<strerror(errno)<<endl;
+    exit(1);
+  }
+  vector<server_query> queries;
+  string line;
+  TIMER_CLEAR;
+  TIMER_START;
+  while (getline(cin,line)) {
+    server_query q;
+    if (line.find_first_not_of(" \t\r")==string::npos) continue;
+    if (!parse_query(line,&q)) {
+      cout<<"Error: not a query: "<<line<<endl;
+      exit(1);
+    }
+    queries.push_back(q);
+    if (queries.size()==SERVER_MAX_BATCH) {
+      run_batch(fd,queries);
+      queries.clear();
+    }
+  }
+  if (!queries.empty()) run_batch(fd,queries);
+  TIMER_STOP;
+  close(fd);
+  cout<<"time="<<setprecision(8)<<TIMER_ELAPSED/1000000.0<<" seconds"<<endl;
+}
+
+/*
+  MAIN ROUTINE
+*/
+int main(int argc,char *argv[])
+{
+  int threads=1;
+  uint64_t cacheMiB=SERVER_CACHE_MIB;
+  uint64_t maxNumber=SERVER_MAX_NUMBER;
+  const char *servePath=0, *queryPath=0;
+  int arg=1;
+  while (arg+1<argc) {
+    if (strcmp(argv[arg],"-t")==0) threads=atoi(argv[arg+1]);
+    else if (strcmp(argv[arg],"-c")==0) {
+      if (!PrimeParseNumber(argv[arg+1],&cacheMiB)) break;
+    }
+    else if (strcmp(argv[arg],"-m")==0) {
+      if (!PrimeParseNumber(argv[arg+1],&maxNumber)) break;
+    }
+    else if (strcmp(argv[arg],"--serve")==0) servePath=argv[arg+1];
+    else if (strcmp(argv[arg],"--query")==0) queryPath=argv[arg+1];
+    else break;
+    arg+=2;
+  }
+  if (arg!=argc || (servePath==0)==(queryPath==0) || threads<=0) {
+    cout<<"usage:  prime_server [-t threads] [-c cacheMiB] [-m maxNumber] --serve <socket>"
+        << endl
+        <<"        prime_server --query <socket>"
+        << endl;
+    exit(1);
+  }
+  if (queryPath) query(queryPath);
+  else {
+    PrimeCheckRange(maxNumber,0,WHEEL_MAX_LIMIT);
+    serve(servePath,threads,cacheMiB,maxNumber);
+  }
+  return 0;
+}
@@ -0,0 +1,896 @@
+//MIT License
+
+//Copyright (c) 2016 Ashton Johnson
+
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+
+/******************************************************************/
+/**
+* Shared sieve storage for the serial, fan-out and daisy-chain drivers
+* @file prime_sieve.h
+* @author Ashton Johnson, Paul Henny
+* @brief Bit-packed mod-30 wheel representation of a sieve array.
+*
+* Multiples of 2, 3 and 5 are never stored.  Byte k of a wheel array
+* covers the numbers [30k, 30k+30) and bit b of that byte stands for
+* 30k+WHEEL_OFFSET[b], the eight residues coprime to 30.  A set bit means
+* the number is still a prime candidate.  One byte therefore replaces
+* thirty entries of the old bool arrays.
+*
+* A block of a wheel array is always addressed by its first byte index
+* (byteLow) so that a rank or a segment can sieve its slice without
+* knowing where the rest of the array lives.
+*
+* Numbers and block positions are 64 bit, but the marking loop only ever
+* walks 32-bit offsets inside a window of at most WHEEL_MAX_WINDOW bytes.
+* Large blocks are struck out window by window, so the inner loop never
+* pays for 64-bit arithmetic.  Sieving primes stay below 2^31, which puts
+* the highest supported number at WHEEL_MAX_LIMIT.
+*
+* The residue tables are computed from WHEEL_SPAN at compile time.  For a
+* prime of a given residue the byte distances and bit masks of its eight
+* multiples within one turn of the wheel are fixed (WheelHit), so the
+* marking loop is instantiated once per residue and clears all eight
+* with constant masks on every turn.  The tables need C++14, the default
+* of g++ 6 and later.
+*
+* WheelInit does not start from all ones: it copies in a repeating
+* pattern that already has the multiples of 7 to 19 struck out, then ANDs
+* in the patterns of the primes up to WHEEL_PRESIEVE_MAX with the widest
+* vector kernel the CPU supports.  Drivers start sieving past that prime.
+* The PRIME_SIMD environment variable (scalar, avx2 or avx512) caps the
+* kernel chosen at run time.
+*/
+#ifndef PRIME_SIEVE_H
+#define PRIME_SIEVE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define WHEEL_X86_SIMD
+#endif
+
+/// Numbers covered by one byte of a wheel array.
+#define WHEEL_SPAN 30
+
+/// Largest window, in bytes, walked with 32-bit offsets.
+#define WHEEL_MAX_WINDOW (1u << 30)
+
+/// Highest number the wheel arrays can be sieved up to.
+#define WHEEL_MAX_LIMIT (1ull << 62)
+
+/// Default window, in bytes, for cache-blocked sieving; sized to L1.
+#define WHEEL_SEGMENT_BYTES 32768
+
+/// Period, in bytes, of the pattern with the multiples of 7 to 19 cleared.
+#define WHEEL_PRESIEVE_PERIOD (7u * 11u * 13u * 17u * 19u)
+
+/// Largest prime struck out by WheelInit; sieving starts past it.
+#define WHEEL_PRESIEVE_MAX 61
+
+/// Widest load of the AND kernels; patterns are padded by this much.
+#define WHEEL_VECTOR_BYTES 64
+
+/// Limits from which segmented sieves queue large primes in buckets.
+#ifndef WHEEL_BUCKET_MIN_LIMIT
+#define WHEEL_BUCKET_MIN_LIMIT 100000000000ull
+#endif
+
+/// Primes that go to the buckets, in segments: a smaller prime hits most
+/// segments anyway and is cheaper to walk in place.
+#ifndef WHEEL_BUCKET_MIN_SEGMENTS
+#define WHEEL_BUCKET_MIN_SEGMENTS 2
+#endif
+
+/// Largest segment the buckets can address; offsets share a word with a bit.
+#define WHEEL_BUCKET_MAX_SEGMENT (1u << 29)
+
+/// Number of residues kept per byte, one per bit.
+#define WHEEL_RESIDUES 8
+
+/// Fewest turns of the wheel a segment must span for the unrolled
+/// marking loop; shorter walks go class by class.
+#define WHEEL_MIN_TURNS 32
+
+/** \brief Residue tables of the wheel, generated from WHEEL_SPAN at
+ * compile time.
+ */
+struct WheelTables {
+  /// the residues modulo WHEEL_SPAN that are kept, in bit order
+  uint32_t offset[WHEEL_RESIDUES];
+  /// bit index for every residue, or -1 if it is not stored
+  int8_t bit[WHEEL_SPAN];
+  /// number of residues coprime to WHEEL_SPAN
+  int residues;
+
+  constexpr WheelTables() : offset(), bit(), residues(0)
+  {
+    for (uint32_t n = 0; n < WHEEL_SPAN; n++) {
+      uint32_t a = n, b = WHEEL_SPAN;
+      while (b) { uint32_t t = a % b; a = b; b = t; }
+      bit[n] = -1;
+      if (a != 1) continue;
+      if (residues < WHEEL_RESIDUES) offset[residues] = n;
+      bit[n] = (int8_t)residues++;
+    }
+  }
+};
+
+static constexpr WheelTables WHEEL_TABLES;
+static_assert(WHEEL_TABLES.residues == WHEEL_RESIDUES,
+              "every residue coprime to WHEEL_SPAN needs its own bit of a byte");
+
+/// The residues modulo 30 that are kept, in bit order: 1 7 11 13 17 19 23 29.
+static constexpr const uint32_t (&WHEEL_OFFSET)[WHEEL_RESIDUES] = WHEEL_TABLES.offset;
+
+/// Bit index for every residue modulo 30, or -1 if it is not stored.
+static constexpr const int8_t (&WHEEL_BIT)[WHEEL_SPAN] = WHEEL_TABLES.bit;
+
+/** \brief Where the multiples of a prime land within one turn of the wheel.
+ *
+ * Write p = 30a + r with r = WHEEL_OFFSET[R] and a cofactor q = 30b + s
+ * with s = WHEEL_OFFSET[I].  Then p*q = 30(bp + as + rs/30) + rs%30, so
+ * the multiple sits in byte b*p + a*s + carry and clears the bit of
+ * rs%30.  Both depend on R and I only and are compile-time constants.
+ */
+template <int R, int I>
+struct WheelHit {
+  static constexpr uint32_t product = WHEEL_OFFSET[R] * WHEEL_OFFSET[I];
+  static constexpr uint32_t carry = product / WHEEL_SPAN;
+  static constexpr uint8_t mask = (uint8_t)~(1u << WHEEL_BIT[product % WHEEL_SPAN]);
+};
+
+/** \brief Sieving state of one prime for a segmented walk.
+ *
+ * The multiples p*q with q coprime to 30 split into eight arithmetic
+ * progressions, one per residue of q.  Each progression advances by
+ * exactly p bytes and always clears the same bit, so only the byte offset
+ * of its next multiple, relative to the current segment, is kept.
+ */
+struct SievingPrime {
+  /// the prime itself, which is also the byte stride of every progression
+  uint32_t prime;
+  /// byte offset of the next multiple in each residue class
+  uint32_t offset[8];
+  /// bit cleared by each residue class
+  uint8_t mask[8];
+};
+
+/** \brief Number of wheel bytes needed to hold the numbers [0, limit). */
+static inline uint64_t WheelBytes(uint64_t limit)
+{
+  return (limit + WHEEL_SPAN - 1) / WHEEL_SPAN;
+}
+
+/** \brief Exact integer square root, floor(sqrt(n)). */
+static inline uint64_t WheelSqrt(uint64_t n)
+{
+  uint64_t r = (uint64_t)sqrt((double)n);
+  while (r * r > n) r--;
+  while ((r + 1) * (r + 1) <= n) r++;
+  return r;
+}
+
+/// Every prime struck out by WheelInit.
+static const uint32_t WHEEL_PRESIEVE_PRIMES[15] = {
+  7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53, 59, 61
+};
+
+/// Primes of the copied pattern.
+static const uint32_t WHEEL_STAMP_PRIMES[5] = {7, 11, 13, 17, 19};
+
+/// Primes ANDed in after the copy, two to a pattern.
+static const uint32_t WHEEL_DENSE_PRIMES[5][2] = {
+  {23, 29}, {31, 37}, {41, 43}, {47, 53}, {59, 61}
+};
+
+/** \brief ANDs a repeating pattern into a block: bytes[i] &= pattern[(phase+i) % period].
+ *
+ * The pattern holds period + WHEEL_VECTOR_BYTES bytes, its start repeated
+ * at the end, and period is at least WHEEL_VECTOR_BYTES, so a vector
+ * load never wraps.
+ */
+typedef void (*WheelAndKernel)(uint8_t *bytes, uint64_t nBytes, const uint8_t *pattern,
+                               uint32_t period, uint32_t phase);
+
+/** \brief Portable AND kernel, one 64-bit word at a time. */
+static inline void WheelAndScalar(uint8_t *bytes, uint64_t nBytes, const uint8_t *pattern,
+                                  uint32_t period, uint32_t phase)
+{
+  uint64_t i = 0;
+  for (; i + 8 <= nBytes; i += 8) {
+    uint64_t word, mask;
+    memcpy(&word, bytes + i, 8);
+    memcpy(&mask, pattern + phase, 8);
+    word &= mask;
+    memcpy(bytes + i, &word, 8);
+    phase += 8;
+    if (phase >= period) phase -= period;
+  }
+  for (; i < nBytes; i++) {
+    bytes[i] &= pattern[phase];
+    if (++phase == period) phase = 0;
+  }
+}
+
+#ifdef WHEEL_X86_SIMD
+/** \brief AVX2 AND kernel, 32 bytes at a time. */
+__attribute__((target("avx2")))
+static inline void WheelAndAvx2(uint8_t *bytes, uint64_t nBytes, const uint8_t *pattern,
+                                uint32_t period, uint32_t phase)
+{
+  uint64_t i = 0;
+  for (; i + 32 <= nBytes; i += 32) {
+    __m256i word = _mm256_loadu_si256((const __m256i *)(bytes + i));
+    __m256i mask = _mm256_loadu_si256((const __m256i *)(pattern + phase));
+    _mm256_storeu_si256((__m256i *)(bytes + i), _mm256_and_si256(word, mask));
+    phase += 32;
+    if (phase >= period) phase -= period;
+  }
+  WheelAndScalar(bytes + i, nBytes - i, pattern, period, phase);
+}
+
+/** \brief AVX-512 AND kernel, 64 bytes at a time. */
+__attribute__((target("avx512f")))
+static inline void WheelAndAvx512(uint8_t *bytes, uint64_t nBytes, const uint8_t *pattern,
+                                  uint32_t period, uint32_t phase)
+{
+  uint64_t i = 0;
+  for (; i + 64 <= nBytes; i += 64) {
+    __m512i word = _mm512_loadu_si512((const void *)(bytes + i));
+    __m512i mask = _mm512_loadu_si512((const void *)(pattern + phase));
+    _mm512_storeu_si512((void *)(bytes + i), _mm512_and_si512(word, mask));
+    phase += 64;
+    if (phase >= period) phase -= period;
+  }
+  WheelAndScalar(bytes + i, nBytes - i, pattern, period, phase);
+}
+#endif
+
+/** \brief Highest instruction set level allowed by PRIME_SIMD: 2 lets
+ * the kernels use AVX-512, 1 AVX2 and POPCNT, 0 only portable code.
+ */
+static inline int WheelSimdCap()
+{
+  const char *cap = getenv("PRIME_SIMD");
+  if (cap && strcmp(cap, "avx2") == 0) return 1;
+  if (cap && strcmp(cap, "scalar") == 0) return 0;
+  return 2;
+}
+
+/** \brief Picks the widest AND kernel this CPU runs, capped by PRIME_SIMD. */
+static inline WheelAndKernel WheelSelectAnd()
+{
+#ifdef WHEEL_X86_SIMD
+  int level = WheelSimdCap();
+  __builtin_cpu_init();
+  if (level >= 2 && __builtin_cpu_supports("avx512f")) return WheelAndAvx512;
+  if (level >= 1 && __builtin_cpu_supports("avx2")) return WheelAndAvx2;
+#endif
+  return WheelAndScalar;
+}
+
+/** \brief Fills pattern[k] with the wheel byte k of a run where the
+ * multiples of the given primes are cleared and everything else is set.
+ * \param length bytes to fill; the pattern repeats every product of primes
+ */
+static inline void WheelPattern(uint8_t *pattern, uint32_t length,
+                                const uint32_t *primes, int count)
+{
+  memset(pattern, 0xff, length);
+  for (int i = 0; i < count; i++) {
+    uint32_t p = primes[i];
+    /// one period of this prime alone, then spread over the pattern
+    std::vector<uint8_t> single(p, 0xff);
+    for (uint32_t k = 0; k < p; k++)
+      for (int b = 0; b < 8; b++)
+        if (((uint64_t)k * WHEEL_SPAN + WHEEL_OFFSET[b]) % p == 0)
+          single[k] &= (uint8_t)~(1u << b);
+    for (uint32_t k = 0, j = 0; k < length; k++) {
+      pattern[k] &= single[j];
+      if (++j == p) j = 0;
+    }
+  }
+}
+
+/** \brief Patterns and kernel used by WheelInit, built on first use. */
+struct WheelPresieve {
+  /// multiples of 7 to 19, WHEEL_PRESIEVE_PERIOD bytes
+  std::vector<uint8_t> stamp;
+  /// multiples of each pair of WHEEL_DENSE_PRIMES, padded for vector loads
+  std::vector<uint8_t> dense[5];
+  uint32_t densePeriod[5];
+  WheelAndKernel andKernel;
+
+  WheelPresieve() : stamp(WHEEL_PRESIEVE_PERIOD), andKernel(WheelSelectAnd())
+  {
+    WheelPattern(&stamp[0], WHEEL_PRESIEVE_PERIOD, WHEEL_STAMP_PRIMES, 5);
+    for (int d = 0; d < 5; d++) {
+      densePeriod[d] = WHEEL_DENSE_PRIMES[d][0] * WHEEL_DENSE_PRIMES[d][1];
+      dense[d].resize(densePeriod[d] + WHEEL_VECTOR_BYTES);
+      WheelPattern(&dense[d][0], (uint32_t)dense[d].size(), WHEEL_DENSE_PRIMES[d], 2);
+    }
+  }
+
+  /// The shared instance; C++11 makes its construction thread-safe.
+  static const WheelPresieve &Get()
+  {
+    static const WheelPresieve instance;
+    return instance;
+  }
+};
+
+/** \brief Initializes a block of a wheel array to all candidates.
+ * \param bytes the block
+ * \param byteLow index of the first byte of the block in the whole array
+ * \param nBytes number of bytes in the block
+ * \param limit numbers at or above limit are cleared
+ *
+ * Multiples of the primes up to WHEEL_PRESIEVE_MAX are already cleared,
+ * but not those primes themselves.  The number 1 is cleared when the
+ * block starts the array.
+ */
+static inline void WheelInit(uint8_t *bytes, uint64_t byteLow, uint64_t nBytes,
+                             uint64_t limit)
+{
+  const WheelPresieve &pre = WheelPresieve::Get();
+  /// copy the 7 to 19 pattern in, wrapping at its period
+  uint32_t phase = (uint32_t)(byteLow % WHEEL_PRESIEVE_PERIOD);
+  for (uint64_t k = 0; k < nBytes; phase = 0) {
+    uint64_t n = WHEEL_PRESIEVE_PERIOD - phase;
+    if (n > nBytes - k) n = nBytes - k;
+    memcpy(bytes + k, &pre.stamp[phase], n);
+    k += n;
+  }
+  for (int d = 0; d < 5; d++)
+    pre.andKernel(bytes, nBytes, &pre.dense[d][0], pre.densePeriod[d],
+                  (uint32_t)(byteLow % pre.densePeriod[d]));
+  /// the patterns struck out their own primes as well; put them back
+  if (byteLow <= WHEEL_PRESIEVE_MAX / WHEEL_SPAN) {
+    for (int i = 0; i < 15; i++) {
+      uint32_t p = WHEEL_PRESIEVE_PRIMES[i];
+      uint64_t k = p / WHEEL_SPAN;
+      if (k >= byteLow && k < byteLow + nBytes)
+        bytes[k - byteLow] |= (uint8_t)(1u << WHEEL_BIT[p % WHEEL_SPAN]);
+    }
+  }
+  if (byteLow == 0 && nBytes > 0) bytes[0] &= (uint8_t)~1;
+  /// byte that holds limit itself; everything past it is cleared
+  uint64_t limitByte = limit / WHEEL_SPAN;
+  if (limitByte >= byteLow + nBytes) return;
+  uint64_t k = 0;
+  if (limitByte >= byteLow) {
+    k = limitByte - byteLow;
+    for (int b = 0; b < 8; b++)
+      if (limitByte * WHEEL_SPAN + WHEEL_OFFSET[b] >= limit)
+        bytes[k] &= (uint8_t)~(1u << b);
+    k++;
+  }
+  memset(bytes + k, 0, nBytes - k);
+}
+
+/** \brief Returns whether n is still marked as a candidate.
+ * \param bytes block of a wheel array that contains n
+ * \param byteLow index of the first byte of the block in the whole array
+ * \param n number to test; 2, 3 and 5 are reported as prime
+ */
+static inline bool WheelTest(const uint8_t *bytes, uint64_t byteLow, uint64_t n)
+{
+  if (n < 7) return n == 2 || n == 3 || n == 5;
+  int bit = WHEEL_BIT[n % WHEEL_SPAN];
+  if (bit < 0) return false;
+  return (bytes[n / WHEEL_SPAN - byteLow] >> bit) & 1;
+}
+
+/** \brief Prepares a prime for sieving the blocks that start at byteLow.
+ * \param from if given, multiples below it are left alone as well
+ *
+ * Multiples below p*p are left alone since a smaller prime strikes them.
+ * The caller only activates a prime once p*p and from fall within 2^32
+ * bytes of byteLow, so that every offset fits in 32 bits.
+ */
+static inline void SievingPrimeInit(SievingPrime &sp, uint32_t p, uint64_t byteLow,
+                                    uint64_t from = 0)
+{
+  uint64_t start = byteLow * WHEEL_SPAN;
+  uint64_t square = (uint64_t)p * p;
+  if (start < square) start = square;
+  if (start < from) start = from;
+  /// smallest cofactor q with p*q >= start
+  uint64_t qMin = (start + p - 1) / p;
+
+  sp.prime = p;
+  for (int i = 0; i < 8; i++) {
+    uint64_t q = qMin - qMin % WHEEL_SPAN + WHEEL_OFFSET[i];
+    if (q < qMin) q += WHEEL_SPAN;
+    uint64_t n = p * q;
+    sp.offset[i] = (uint32_t)(n / WHEEL_SPAN - byteLow);
+    sp.mask[i] = (uint8_t)~(1u << WHEEL_BIT[n % WHEEL_SPAN]);
+  }
+}
+
+/** \brief Strikes the multiples of one prime out of a segment, one
+ * residue class after the other.
+ */
+static inline void SieveSegmentClasses(uint8_t *bytes, uint32_t nBytes, SievingPrime &sp)
+{
+  const uint32_t p = sp.prime;
+  for (int i = 0; i < 8; i++) {
+    uint32_t j = sp.offset[i];
+    const uint8_t mask = sp.mask[i];
+    for (; j < nBytes; j += p) bytes[j] &= mask;
+    sp.offset[i] = j - nBytes;
+  }
+}
+
+/** \brief Strikes the multiples of a prime congruent to WHEEL_OFFSET[R]
+ * out of a segment, a whole turn of the wheel per iteration.
+ *
+ * Every turn of eight cofactors covers p bytes and clears one bit at each
+ * of eight fixed distances from its start (see WheelHit), so the loop
+ * body is eight stores with constant masks.  The progressions that are
+ * one turn behind the rest first catch up, and the turn that runs past
+ * the end of the segment is finished class by class.  Segments too short
+ * for a whole turn go to SieveSegmentClasses.
+ */
+template <int R>
+static inline void SieveSegmentTurns(uint8_t *bytes, uint32_t nBytes, SievingPrime &sp)
+{
+  const uint32_t p = sp.prime, a = p / WHEEL_SPAN;
+  const uint32_t d0 = a * WHEEL_OFFSET[0] + WheelHit<R, 0>::carry;
+  const uint32_t d1 = a * WHEEL_OFFSET[1] + WheelHit<R, 1>::carry;
+  const uint32_t d2 = a * WHEEL_OFFSET[2] + WheelHit<R, 2>::carry;
+  const uint32_t d3 = a * WHEEL_OFFSET[3] + WheelHit<R, 3>::carry;
+  const uint32_t d4 = a * WHEEL_OFFSET[4] + WheelHit<R, 4>::carry;
+  const uint32_t d5 = a * WHEEL_OFFSET[5] + WheelHit<R, 5>::carry;
+  const uint32_t d6 = a * WHEEL_OFFSET[6] + WheelHit<R, 6>::carry;
+  const uint32_t d7 = a * WHEEL_OFFSET[7] + WheelHit<R, 7>::carry;
+  const uint32_t d[8] = {d0, d1, d2, d3, d4, d5, d6, d7};
+
+  /// start of the earliest turn any progression is in; the others are
+  /// exactly one turn ahead
+  int64_t turn = (int64_t)sp.offset[0] - d0;
+  for (int i = 1; i < 8; i++)
+    if ((int64_t)sp.offset[i] - d[i] < turn) turn = (int64_t)sp.offset[i] - d[i];
+  if (turn + p + d7 >= nBytes) {
+    SieveSegmentClasses(bytes, nBytes, sp);
+    return;
+  }
+  for (int i = 0; i < 8; i++)
+    if ((int64_t)sp.offset[i] - d[i] == turn) bytes[turn + d[i]] &= sp.mask[i];
+
+  uint8_t *b = bytes + turn + p;
+  uint8_t *const end = bytes + nBytes - d7;
+  for (; b < end; b += p) {
+    b[d0] &= WheelHit<R, 0>::mask;
+    b[d1] &= WheelHit<R, 1>::mask;
+    b[d2] &= WheelHit<R, 2>::mask;
+    b[d3] &= WheelHit<R, 3>::mask;
+    b[d4] &= WheelHit<R, 4>::mask;
+    b[d5] &= WheelHit<R, 5>::mask;
+    b[d6] &= WheelHit<R, 6>::mask;
+    b[d7] &= WheelHit<R, 7>::mask;
+  }
+  uint32_t j = (uint32_t)(b - bytes);
+  for (int i = 0; i < 8; i++) {
+    uint32_t k = j + d[i];
+    if (k < nBytes) {
+      bytes[k] &= sp.mask[i];
+      k += p;
+    }
+    sp.offset[i] = k - nBytes;
+  }
+}
+
+/** \brief Strikes the multiples of one prime out of a segment.
+ * \param bytes segment of a wheel array
+ * \param nBytes number of bytes in the segment, at most WHEEL_MAX_WINDOW
+ * \param sp sieving state, advanced so that it points into the next segment
+ */
+static inline void SieveSegment(uint8_t *bytes, uint32_t nBytes, SievingPrime &sp)
+{
+  /// the unrolled loop only pays for its setup over many turns
+  if ((uint64_t)sp.prime * WHEEL_MIN_TURNS > nBytes) {
+    SieveSegmentClasses(bytes, nBytes, sp);
+    return;
+  }
+  switch (WHEEL_BIT[sp.prime % WHEEL_SPAN]) {
+  case 0: SieveSegmentTurns<0>(bytes, nBytes, sp); break;
+  case 1: SieveSegmentTurns<1>(bytes, nBytes, sp); break;
+  case 2: SieveSegmentTurns<2>(bytes, nBytes, sp); break;
+  case 3: SieveSegmentTurns<3>(bytes, nBytes, sp); break;
+  case 4: SieveSegmentTurns<4>(bytes, nBytes, sp); break;
+  case 5: SieveSegmentTurns<5>(bytes, nBytes, sp); break;
+  case 6: SieveSegmentTurns<6>(bytes, nBytes, sp); break;
+  default: SieveSegmentTurns<7>(bytes, nBytes, sp); break;
+  }
+}
+
+/** \brief Next hit of one progression of a large prime.
+ *
+ * position holds the byte offset within the target segment, shifted left
+ * by three, and the bit the progression clears in its low three bits.
+ */
+struct BucketEntry {
+  uint32_t prime;
+  uint32_t position;
+};
+
+/** \brief Bucket sieve for primes at least as large as a segment.
+ *
+ * Such a prime hits a segment at most once per residue class, and often
+ * not at all, so walking every one of them for every segment costs more
+ * than the marking.  Each progression is instead queued in the bucket of
+ * the segment that holds its next multiple.  A segment only visits its
+ * own bucket and requeues every entry further ahead.  Buckets form a ring
+ * long enough to cover the largest stride.
+ */
+struct BucketSieve {
+  /// segments are 2^shift bytes, so positions split with shifts and masks
+  uint32_t shift;
+  /// index of the segment the next BucketSieveSegment call sieves
+  uint64_t segment;
+  /// a power of two of buckets, less one
+  uint64_t ringMask;
+  std::vector<std::vector<BucketEntry> > ring;
+};
+
+/** \brief Sets up empty buckets for primes up to largestPrime.
+ * \param segmentBytes size of every segment but the last, a power of two
+ * no larger than WHEEL_BUCKET_MAX_SEGMENT
+ */
+static inline void BucketSieveInit(BucketSieve &bs, uint32_t segmentBytes, uint32_t largestPrime)
+{
+  bs.shift = __builtin_ctz(segmentBytes);
+  bs.segment = 0;
+  uint64_t buckets = 1;
+  while (buckets < (largestPrime >> bs.shift) + 2) buckets <<= 1;
+  bs.ringMask = buckets - 1;
+  bs.ring.assign(buckets, std::vector<BucketEntry>());
+}
+
+/** \brief Queues the eight progressions of a prime of at least segmentBytes.
+ * \param segmentLow index of the first byte of the segment about to be sieved
+ */
+static inline void BucketSieveAdd(BucketSieve &bs, uint32_t p, uint64_t segmentLow)
+{
+  SievingPrime sp;
+  SievingPrimeInit(sp, p, segmentLow);
+  const uint32_t segmentMask = (1u << bs.shift) - 1;
+  for (int i = 0; i < 8; i++) {
+    BucketEntry e;
+    e.prime = p;
+    e.position = (sp.offset[i] & segmentMask) << 3 | __builtin_ctz((uint8_t)~sp.mask[i]);
+    uint64_t target = bs.segment + (sp.offset[i] >> bs.shift);
+    bs.ring[target & bs.ringMask].push_back(e);
+  }
+}
+
+/** \brief Strikes the queued multiples out of the current segment and
+ * requeues each progression for the segment of its next multiple.
+ * \param nBytes size of this segment, less than segmentBytes only for
+ * the last one
+ */
+static inline void BucketSieveSegment(BucketSieve &bs, uint8_t *bytes, uint32_t nBytes)
+{
+  const uint32_t shift = bs.shift, segmentMask = (1u << shift) - 1;
+  std::vector<BucketEntry> &bucket = bs.ring[bs.segment & bs.ringMask];
+  for (size_t k = 0; k < bucket.size(); k++) {
+    BucketEntry e = bucket[k];
+    uint32_t offset = e.position >> 3;
+    if (offset < nBytes) bytes[offset] &= (uint8_t)~(1u << (e.position & 7));
+    /// a stride of at least one segment always lands in a later bucket
+    uint64_t next = (uint64_t)offset + e.prime;
+    e.position = (uint32_t)(next & segmentMask) << 3 | (e.position & 7);
+    bs.ring[(bs.segment + (next >> shift)) & bs.ringMask].push_back(e);
+  }
+  bucket.clear();
+  bs.segment++;
+}
+
+/** \brief Strikes all multiples of p out of a block of a wheel array.
+ * \param bytes the block
+ * \param byteLow index of the first byte of the block in the whole array
+ * \param nBytes number of bytes in the block
+ * \param p the prime
+ * \param from if given, the first multiple to strike, as handed on by
+ * whoever struck the numbers below it; p*p when it lies further on
+ */
+static inline void WheelMark(uint8_t *bytes, uint64_t byteLow, uint64_t nBytes, uint32_t p,
+                             uint64_t from = 0)
+{
+  uint64_t start = (uint64_t)p * p;
+  if (start < from) start = from;
+  /// nothing to do if the first multiple lies beyond the block
+  if (start >= (byteLow + nBytes) * WHEEL_SPAN) return;
+  /// skip the windows that lie entirely below it
+  uint64_t skip = 0;
+  uint64_t startByte = start / WHEEL_SPAN;
+  if (startByte > byteLow) skip = (startByte - byteLow) / WHEEL_MAX_WINDOW * WHEEL_MAX_WINDOW;
+
+  SievingPrime sp;
+  SievingPrimeInit(sp, p, byteLow + skip, from);
+  for (uint64_t low = skip; low < nBytes; low += WHEEL_MAX_WINDOW) {
+    uint32_t window = (uint32_t)(nBytes - low < WHEEL_MAX_WINDOW ? nBytes - low : WHEEL_MAX_WINDOW);
+    SieveSegment(bytes + low, window, sp);
+  }
+}
+
+/** \brief Counts set bits one 64-bit word at a time.
+ *
+ * Always inlined, so each caller compiles the loop for its own target.
+ */
+__attribute__((always_inline))
+static inline uint64_t WheelCountWords(const uint8_t *bytes, uint64_t nBytes)
+{
+  uint64_t count = 0, i = 0;
+  for (; i + 8 <= nBytes; i += 8) {
+    uint64_t word;
+    memcpy(&word, bytes + i, 8);
+    count += __builtin_popcountll(word);
+  }
+  for (; i < nBytes; i++) count += __builtin_popcount(bytes[i]);
+  return count;
+}
+
+#ifdef WHEEL_X86_SIMD
+/** \brief WheelCountWords compiled to the POPCNT instruction. */
+__attribute__((target("popcnt")))
+static inline uint64_t WheelCountPopcnt(const uint8_t *bytes, uint64_t nBytes)
+{
+  return WheelCountWords(bytes, nBytes);
+}
+#endif
+
+typedef uint64_t (*WheelCountKernel)(const uint8_t *bytes, uint64_t nBytes);
+
+/** \brief Picks the hardware popcount when the CPU has it and PRIME_SIMD allows. */
+static inline WheelCountKernel WheelSelectCount()
+{
+#ifdef WHEEL_X86_SIMD
+  __builtin_cpu_init();
+  if (WheelSimdCap() >= 1 && __builtin_cpu_supports("popcnt")) return WheelCountPopcnt;
+#endif
+  return WheelCountWords;
+}
+
+/** \brief Counts the candidates left in a block of a wheel array.
+ *
+ * 2, 3 and 5 are not stored and have to be added by the caller.
+ */
+static inline uint64_t WheelCount(const uint8_t *bytes, uint64_t nBytes)
+{
+  static const WheelCountKernel kernel = WheelSelectCount();
+  return kernel(bytes, nBytes);
+}
+
+/** \brief How many of the unstored primes 2, 3 and 5 lie below limit. */
+static inline uint64_t WheelUnstored(uint64_t limit)
+{
+  return (limit > 2) + (limit > 3) + (limit > 5);
+}
+
+/** \brief Clears the numbers below low from a block of a wheel array.
+ * \return the number of candidates that were cleared
+ *
+ * A range that starts at low begins with the byte that holds low, so only
+ * the first bits of that byte have to go.  2, 3 and 5 are not stored; the
+ * caller skips those below low itself.
+ */
+static inline uint64_t WheelClearBelow(uint8_t *bytes, uint64_t byteLow, uint64_t nBytes,
+                                       uint64_t low)
+{
+  uint64_t lowByte = low / WHEEL_SPAN;
+  if (lowByte < byteLow) return 0;
+  uint64_t k = lowByte - byteLow;
+  if (k > nBytes) k = nBytes;
+  uint64_t cleared = WheelCount(bytes, k);
+  memset(bytes, 0, k);
+  if (k == nBytes) return cleared;
+  for (int b = 0; b < 8; b++)
+    if (lowByte * WHEEL_SPAN + WHEEL_OFFSET[b] < low && (bytes[k] >> b & 1)) {
+      bytes[k] &= (uint8_t)~(1u << b);
+      cleared++;
+    }
+  return cleared;
+}
+
+/** \brief Calls visit(n) for every prime held in a block, in order.
+ *
+ * 2, 3 and 5 are reported, when below limit, if the block starts the array.
+ */
+template <typename Visitor>
+static inline void WheelForEachPrime(const uint8_t *bytes, uint64_t byteLow,
+                                     uint64_t nBytes, uint64_t limit, Visitor visit)
+{
+  static const uint64_t SMALL[3] = {2, 3, 5};
+  for (int s = 0; s < 3 && byteLow == 0; s++)
+    if (SMALL[s] < limit) visit(SMALL[s]);
+  for (uint64_t i = 0; i < nBytes; i++) {
+    for (uint8_t bits = bytes[i]; bits; bits &= bits - 1)
+      visit((byteLow + i) * WHEEL_SPAN + WHEEL_OFFSET[__builtin_ctz(bits)]);
+  }
+}
+
+/** \brief Largest prime held in a block, or 0 if there is none.
+ *
+ * 2, 3 and 5 count, when below limit, if the block starts the array.
+ */
+static inline uint64_t WheelLastPrime(const uint8_t *bytes, uint64_t byteLow,
+                                      uint64_t nBytes, uint64_t limit)
+{
+  for (uint64_t i = nBytes; i-- > 0; )
+    if (bytes[i])
+      return (byteLow + i) * WHEEL_SPAN + WHEEL_OFFSET[31 - __builtin_clz(bytes[i])];
+  static const uint64_t SMALL[3] = {5, 3, 2};
+  for (int s = 0; s < 3 && byteLow == 0; s++)
+    if (SMALL[s] < limit) return SMALL[s];
+  return 0;
+}
+
+/** \brief Finds all primes below limit with a small unsegmented sieve.
+ * \param limit exclusive upper bound, normally sqrt(highestNumber)+1
+ * \param primes receives the primes in increasing order
+ *
+ * These are the base primes used to strike out every segment.
+ */
+static inline void WheelBasePrimes(uint32_t limit, std::vector<uint32_t> &primes)
+{
+  uint64_t numBytes = WheelBytes(limit);
+  std::vector<uint8_t> isPrime(numBytes + 1);
+  WheelInit(&isPrime[0], 0, numBytes, limit);
+  for (uint32_t i = WHEEL_PRESIEVE_MAX + 1; (uint64_t)i * i < limit; i++)
+    if (WheelTest(&isPrime[0], 0, i)) WheelMark(&isPrime[0], 0, numBytes, i);
+  WheelForEachPrime(&isPrime[0], 0, numBytes, limit,
+                    [&](uint64_t p) { primes.push_back((uint32_t)p); });
+}
+
+/** \brief Sieves a block of a wheel array in place, one window at a time.
+ * \param bytes the block; it does not need to be initialized
+ * \param byteLow index of the first byte of the block in the whole array
+ * \param nBytes number of bytes in the block
+ * \param limit numbers at or above limit are cleared
+ * \param primes base primes up to at least sqrt of the block's last number
+ * \param segmentBytes window size, at most WHEEL_MAX_WINDOW
+ * \param visit called as visit(window, windowByteLow, windowBytes) for
+ * every window once it is sieved, while it is still in cache; it may
+ * clear bits of the window
+ * \param numPrimes number of base primes at primes, which may lie in
+ * memory shared with other processes; they are only read
+ * \param inPlace if false, bytes holds a single window of segmentBytes
+ * that every window is sieved into in turn, so a range of any size takes
+ * O(segmentBytes) memory
+ *
+ * Each window is initialized and struck out by every base prime while it
+ * is resident in cache.  A base prime joins the walk in the window that
+ * holds its square and then carries its offsets from window to window.
+ * From WHEEL_BUCKET_MIN_LIMIT on, with a power-of-two window, primes of
+ * at least WHEEL_BUCKET_MIN_SEGMENTS windows go to a BucketSieve instead.
+ */
+template <typename Visitor>
+static inline void WheelSieveWindows(uint8_t *bytes, uint64_t byteLow, uint64_t nBytes,
+                                     uint64_t limit, const uint32_t *primes, size_t numPrimes,
+                                     uint32_t segmentBytes, Visitor visit, bool inPlace = true)
+{
+  std::vector<SievingPrime> sieving;
+  /// next base prime to join; smaller ones are taken care of by WheelInit
+  size_t next = 0;
+  while (next < numPrimes && primes[next] <= WHEEL_PRESIEVE_MAX) next++;
+  /// primes from here on are queued in buckets; none if buckets are off
+  uint32_t bucketPrime = UINT32_MAX;
+  BucketSieve buckets;
+  if (limit >= WHEEL_BUCKET_MIN_LIMIT && segmentBytes <= WHEEL_BUCKET_MAX_SEGMENT
+      && (segmentBytes & (segmentBytes - 1)) == 0 && numPrimes > 0) {
+    bucketPrime = segmentBytes * WHEEL_BUCKET_MIN_SEGMENTS;
+    BucketSieveInit(buckets, segmentBytes, primes[numPrimes - 1]);
+  }
+
+  for (uint64_t low = 0; low < nBytes; low += segmentBytes) {
+    uint32_t window = (uint32_t)(nBytes - low < segmentBytes ? nBytes - low : segmentBytes);
+    uint64_t windowEnd = (byteLow + low + window) * WHEEL_SPAN;
+    uint8_t *at = inPlace ? bytes + low : bytes;
+    WheelInit(at, byteLow + low, window, limit);
+    for (; next < numPrimes && (uint64_t)primes[next] * primes[next] < windowEnd; next++) {
+      if (primes[next] >= bucketPrime) {
+        BucketSieveAdd(buckets, primes[next], byteLow + low);
+        continue;
+      }
+      SievingPrime sp;
+      SievingPrimeInit(sp, primes[next], byteLow + low);
+      sieving.push_back(sp);
+    }
+    for (size_t k = 0; k < sieving.size(); k++)
+      SieveSegment(at, window, sieving[k]);
+    if (bucketPrime != UINT32_MAX) BucketSieveSegment(buckets, at, window);
+    visit(at, byteLow + low, window);
+  }
+}
+
+/** \brief WheelSieveWindows with the base primes in a vector. */
+template <typename Visitor>
+static inline void WheelSieveWindows(uint8_t *bytes, uint64_t byteLow, uint64_t nBytes,
+                                     uint64_t limit, const std::vector<uint32_t> &primes,
+                                     uint32_t segmentBytes, Visitor visit, bool inPlace = true)
+{
+  WheelSieveWindows(bytes, byteLow, nBytes, limit, primes.empty() ? 0 : &primes[0],
+                    primes.size(), segmentBytes, visit, inPlace);
+}
+
+/** \brief Sieves a block like WheelSieveWindows.
+ * \param count if not null, the candidates left in each window are added
+ * to it while the window is still in cache
+ */
+static inline void WheelSieveBlock(uint8_t *bytes, uint64_t byteLow, uint64_t nBytes,
+                                   uint64_t limit, const std::vector<uint32_t> &primes,
+                                   uint32_t segmentBytes, uint64_t *count = 0)
+{
+  WheelSieveWindows(bytes, byteLow, nBytes, limit, primes, segmentBytes,
+                    [&](const uint8_t *window, uint64_t, uint32_t n) {
+                      if (count) *count += WheelCount(window, n);
+                    });
+}
+
+/** \brief Appends the primes of a block as LEB128 varint gaps.
+ * \param base number the first gap is measured from, normally the first
+ * number of the block
+ * \param out receives seven bits per byte, high bit set on all but the
+ * last byte of each gap
+ *
+ * Gaps are never zero, so a zero byte between two values can be used as
+ * padding and is skipped by WheelDecodeDeltas.
+ */
+static inline void WheelEncodeDeltas(const uint8_t *bytes, uint64_t byteLow, uint64_t nBytes,
+                                     uint64_t limit, uint64_t base, std::vector<uint8_t> &out)
+{
+  uint64_t previous = base;
+  WheelForEachPrime(bytes, byteLow, nBytes, limit, [&](uint64_t p) {
+    uint64_t gap = p - previous;
+    previous = p;
+    while (gap >= 0x80) { out.push_back((uint8_t)(gap | 0x80)); gap >>= 7; }
+    out.push_back((uint8_t)gap);
+  });
+}
+
+/** \brief Calls visit(p) for every prime of a list written by WheelEncodeDeltas.
+ * \param in the encoded gaps
+ * \param nBytes length of the encoded list, padding included
+ * \param base number the first gap is measured from
+ */
+template <typename Visitor>
+static inline void WheelDecodeDeltas(const uint8_t *in, uint64_t nBytes, uint64_t base,
+                                     Visitor visit)
+{
+  uint64_t value = base;
+  for (uint64_t i = 0; i < nBytes; ) {
+    if (in[i] == 0) { i++; continue; }
+    uint64_t gap = 0;
+    for (int shift = 0; i < nBytes; shift += 7) {
+      gap |= (uint64_t)(in[i] & 0x7f) << shift;
+      if (!(in[i++] & 0x80)) break;
+    }
+    value += gap;
+    visit(value);
+  }
+}
+
+#endif /* PRIME_SIEVE_H */
@@ -0,0 +1,263 @@
+//MIT License
+
+//Copyright (c) 2016 Ashton Johnson
+
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+
+/******************************************************************/
+/**
+* Statistics gathered while sieving
+* @file prime_stats.h
+* @author Ashton Johnson, Paul Henny
+* @brief Twin primes, prime triplets and quadruplets, the sum of the
+* primes and the maximal gaps, in the same pass that counts them.
+*
+* A PrimeStats describes the primes of one stretch of numbers.  It is fed
+* with PrimeStatsAdd window by window, while the window is still in cache.
+* Two stretches, one right after the other, are combined with
+* PrimeStatsMerge.  That only needs the first and last PRIME_STATS_EDGE
+* primes of each, which is why they are kept.  The threads of a rank merge
+* in slice order.  The ranks merge with PrimeStatsReduce, a
+* non-commutative MPI_Op applied in rank order.
+*
+* Constellations are counted at their largest member: twins (p, p+2),
+* triplets (p, p+2, p+6) and (p, p+4, p+6), and quadruplets
+* (p, p+2, p+6, p+8).  Each is a run of consecutive primes.  The gap
+* records are the gaps longer than every earlier one in the stretch.  At
+* most PRIME_STATS_RECORDS are kept, and when there are more the earliest
+* are dropped.
+*/
+#ifndef PRIME_STATS_H
+#define PRIME_STATS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <iostream>
+#include <string>
+#include "prime_sieve.h"
+
+/// Primes kept from either end of a stretch: one less than the largest
+/// constellation.
+#define PRIME_STATS_EDGE 3
+
+/// Gap records kept; below 2^64 there are about 80.
+#define PRIME_STATS_RECORDS 96
+
+/// Statistics of the primes in a stretch of numbers.
+struct PrimeStats {
+  uint64_t count;
+  uint64_t twins, triplets, quadruplets;
+  /// sum of the primes; it overflows 64 bits from about 4*10^10 on
+  unsigned __int128 sum;
+  /// the first primes of the stretch, valid up to count
+  uint64_t first[PRIME_STATS_EDGE];
+  /// the last primes, newest last, valid from the end up to count
+  uint64_t tail[PRIME_STATS_EDGE];
+  /// gap records in increasing order, and the prime each one starts at
+  uint32_t records;
+  uint64_t recordGap[PRIME_STATS_RECORDS];
+  uint64_t recordPrime[PRIME_STATS_RECORDS];
+
+  PrimeStats() { memset(this, 0, sizeof(*this)); }
+};
+
+/** \brief Appends a gap record, dropping the earliest when full. */
+static inline void PrimeStatsRecord(PrimeStats &s, uint64_t gap, uint64_t prime)
+{
+  if (s.records == PRIME_STATS_RECORDS) {
+    memmove(s.recordGap, s.recordGap + 1, (PRIME_STATS_RECORDS - 1) * sizeof(uint64_t));
+    memmove(s.recordPrime, s.recordPrime + 1, (PRIME_STATS_RECORDS - 1) * sizeof(uint64_t));
+    s.records--;
+  }
+  s.recordGap[s.records] = gap;
+  s.recordPrime[s.records] = prime;
+  s.records++;
+}
+
+/** \brief Adds the next prime p of the stretch.
+ * \param inner how many primes of a merged stretch came before p.
+ * Constellations that lie entirely in that stretch, and its gaps, were
+ * counted there already; 0 when p is simply the next prime.
+ */
+static inline void PrimeStatsStep(PrimeStats &s, uint64_t p, int inner = 0)
+{
+  uint64_t n = s.count;
+  const uint64_t *t = s.tail;
+  if (n >= 1 && inner == 0) {
+    uint64_t gap = p - t[2];
+    if (s.records == 0 || gap > s.recordGap[s.records - 1]) PrimeStatsRecord(s, gap, t[2]);
+  }
+  if (n >= 1 && inner < 1 && t[2] == p - 2) s.twins++;
+  if (n >= 2 && inner < 2 && t[1] == p - 6 && (t[2] == p - 4 || t[2] == p - 2)) s.triplets++;
+  if (n >= 3 && inner < 3 && t[0] == p - 8 && t[1] == p - 6 && t[2] == p - 2) s.quadruplets++;
+  if (n < PRIME_STATS_EDGE) s.first[n] = p;
+  s.tail[0] = t[1];
+  s.tail[1] = t[2];
+  s.tail[2] = p;
+  s.count++;
+  s.sum += p;
+}
+
+/** \brief Adds the primes of a sieved block in [lowest, limit).
+ * \param bytes the block, in the layout of WheelForEachPrime
+ * \param byteLow index of the first byte of the block in the whole array
+ *
+ * The block must follow on from whatever s already holds.  The first
+ * few primes go through PrimeStatsStep.  The rest run the same tests on
+ * local copies of the state, which keeps it in registers.  The bits are
+ * taken 64 at a time, so the loop over them ends once per word rather
+ * than once per byte.
+ */
+static inline void PrimeStatsAdd(PrimeStats &s, const uint8_t *bytes, uint64_t byteLow,
+                                 uint64_t nBytes, uint64_t lowest, uint64_t limit)
+{
+  uint64_t i = 0;
+  for (; i < nBytes && s.count < PRIME_STATS_EDGE; i++)
+    WheelForEachPrime(bytes + i, byteLow + i, 1, limit, [&](uint64_t p) {
+      if (p >= lowest && p < limit) PrimeStatsStep(s, p);
+    });
+  if (i == nBytes) return;
+  uint64_t count = 0, twins = 0, triplets = 0, quadruplets = 0;
+  uint64_t t0 = s.tail[0], t1 = s.tail[1], t2 = s.tail[2];
+  uint64_t maxGap = s.recordGap[s.records - 1];
+  unsigned __int128 sum = 0;
+  while (i < nBytes) {
+    uint64_t word = 0, base = (byteLow + i) * WHEEL_SPAN;
+    int n = nBytes - i < 8 ? (int)(nBytes - i) : 8;
+    memcpy(&word, bytes + i, n);
+    i += n;
+    for (; word; word &= word - 1) {
+      int bit = __builtin_ctzll(word);
+      uint64_t p = base + (bit >> 3) * WHEEL_SPAN + WHEEL_OFFSET[bit & 7];
+      if (p < lowest || p >= limit) continue;
+      if (p - t2 > maxGap) {
+        maxGap = p - t2;
+        PrimeStatsRecord(s, maxGap, t2);
+      }
+      twins += t2 == p - 2;
+      triplets += t1 == p - 6 && (t2 == p - 4 || t2 == p - 2);
+      quadruplets += t0 == p - 8 && t1 == p - 6 && t2 == p - 2;
+      t0 = t1;
+      t1 = t2;
+      t2 = p;
+      count++;
+      sum += p;
+    }
+  }
+  s.tail[0] = t0;
+  s.tail[1] = t1;
+  s.tail[2] = t2;
+  s.count += count;
+  s.twins += twins;
+  s.triplets += triplets;
+  s.quadruplets += quadruplets;
+  s.sum += sum;
+}
+
+/** \brief Appends the stretch b, which starts where a ends, to a.
+ *
+ * The first primes of b are replayed after the last ones of a to find
+ * what spans the border; everything else just adds up.
+ */
+static inline void PrimeStatsMerge(PrimeStats &a, const PrimeStats &b)
+{
+  if (b.count == 0) return;
+  if (a.count == 0) { a = b; return; }
+  uint64_t count = a.count + b.count;
+  unsigned __int128 sum = a.sum + b.sum;
+  int edge = b.count < PRIME_STATS_EDGE ? (int)b.count : PRIME_STATS_EDGE;
+  for (int j = 0; j < edge; j++) PrimeStatsStep(a, b.first[j], j);
+  a.count = count;
+  a.sum = sum;
+  a.twins += b.twins;
+  a.triplets += b.triplets;
+  a.quadruplets += b.quadruplets;
+  for (uint32_t r = 0; r < b.records; r++)
+    if (b.recordGap[r] > a.recordGap[a.records - 1])
+      PrimeStatsRecord(a, b.recordGap[r], b.recordPrime[r]);
+  if (b.count >= PRIME_STATS_EDGE) memcpy(a.tail, b.tail, sizeof(a.tail));
+}
+
+/** \brief Writes a 128-bit number in decimal. */
+static inline std::string PrimeStatsDecimal(unsigned __int128 v)
+{
+  std::string digits;
+  do {
+    digits.insert(digits.begin(), (char)('0' + (int)(v % 10)));
+    v /= 10;
+  } while (v != 0);
+  return digits;
+}
+
+/** \brief Prints the statistics as name=value lines.
+ *
+ * The gap records come out as gap@prime, the prime before the gap.
+ */
+static inline void PrimeStatsPrint(const PrimeStats &s, std::ostream &out)
+{
+  out << "twins=" << s.twins << "\n"
+      << "triplets=" << s.triplets << "\n"
+      << "quadruplets=" << s.quadruplets << "\n"
+      << "sum=" << PrimeStatsDecimal(s.sum) << "\n";
+  if (s.records > 0) {
+    out << "maxgap=" << s.recordGap[s.records - 1] << " after "
+        << s.recordPrime[s.records - 1] << "\n";
+    out << "gaps=";
+    for (uint32_t r = 0; r < s.records; r++)
+      out << (r ? "," : "") << s.recordGap[r] << "@" << s.recordPrime[r];
+    out << "\n";
+  }
+  out << std::flush;
+}
+
+#ifdef MPI_VERSION
+/** \brief MPI_Op body: inout = in followed by inout, element by element.
+ *
+ * MPI applies a non-commutative operation with the lower ranks in in.
+ */
+static inline void PrimeStatsReduceOp(void *in, void *inout, int *len, MPI_Datatype *)
+{
+  const PrimeStats *lower = (const PrimeStats *)in;
+  PrimeStats *higher = (PrimeStats *)inout;
+  for (int i = 0; i < *len; i++) {
+    PrimeStats merged = lower[i];
+    PrimeStatsMerge(merged, higher[i]);
+    higher[i] = merged;
+  }
+}
+
+/** \brief Merges the statistics of every rank, in rank order, on rank 0.
+ *
+ * Collective over comm; each rank's stretch must follow the previous
+ * rank's.  Only defined where mpi.h is included before this file.
+ */
+static inline void PrimeStatsReduce(const PrimeStats &local, PrimeStats &total, MPI_Comm comm)
+{
+  MPI_Datatype type;
+  MPI_Op op;
+  MPI_Type_contiguous(sizeof(PrimeStats), MPI_BYTE, &type);
+  MPI_Type_commit(&type);
+  MPI_Op_create(PrimeStatsReduceOp, 0, &op);
+  MPI_Reduce((void *)&local, &total, 1, type, op, 0, comm);
+  MPI_Op_free(&op);
+  MPI_Type_free(&type);
+}
+#endif
+
+#endif /* PRIME_STATS_H */
@@ -0,0 +1,218 @@
+//MIT License
+
+//Copyright (c) 2016 Ashton Johnson
+
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+
+/******************************************************************/
+/**
+* Primality test for single 64-bit numbers
+* @file prime_test.h
+* @author Ashton Johnson, Paul Henny
+* @brief Answers "is n prime?" for any n below 2^64 without sieving up to n.
+*
+* A number is first divided by the odd primes below PRIME_TEST_TRIAL,
+* taken from the sieve.  Each division is a multiplication by the
+* prime's inverse modulo 2^64 and one comparison.  Numbers below
+* PRIME_TEST_TRIAL squared are settled by that alone.  Larger ones get the
+* strong probable prime test to the seven bases of PRIME_TEST_BASES,
+* which has no pseudoprimes below 2^64, so the answer is exact.
+*
+* The modular arithmetic is in Montgomery form: a product modulo n costs
+* three multiplications and no division.  Base 2 runs first and rejects
+* nearly every composite.  The other six bases share the exponent and run
+* in lock step, so their independent multiplications overlap in the
+* pipeline.
+*/
+#ifndef PRIME_TEST_H
+#define PRIME_TEST_H
+
+#include <stdint.h>
+#include <vector>
+#include "prime_sieve.h"
+#include "prime_threads.h"
+
+/// Trial division covers the primes below this.
+#define PRIME_TEST_TRIAL 1024
+
+/// Bases whose strong probable prime test is exact below 2^64.
+static const uint64_t PRIME_TEST_BASES[7] = {
+  2, 325, 9375, 28178, 450775, 9780504, 1795265022
+};
+
+/// Odd prime p with what it takes to test divisibility by it.
+struct PrimeTestDivisor {
+  uint64_t prime;
+  /// p^-1 modulo 2^64
+  uint64_t inverse;
+  /// n is a multiple of p exactly when n*inverse <= limit
+  uint64_t limit;
+};
+
+/** \brief Inverse of an odd n modulo 2^64.
+ *
+ * n is its own inverse to 3 bits and every Newton step doubles that.
+ */
+static inline uint64_t PrimeTestInverse(uint64_t n)
+{
+  uint64_t x = n;
+  for (int i = 0; i < 5; i++) x *= 2 - n * x;
+  return x;
+}
+
+/// Trial divisors, built once from the sieve.
+struct PrimeTestTable {
+  std::vector<PrimeTestDivisor> divisors;
+
+  PrimeTestTable()
+  {
+    std::vector<uint32_t> primes;
+    WheelBasePrimes(PRIME_TEST_TRIAL, primes);
+    for (size_t k = 0; k < primes.size(); k++) {
+      if (primes[k] == 2) continue;
+      PrimeTestDivisor d;
+      d.prime = primes[k];
+      d.inverse = PrimeTestInverse(d.prime);
+      d.limit = UINT64_MAX / d.prime;
+      divisors.push_back(d);
+    }
+  }
+
+  static const PrimeTestTable &Get()
+  {
+    static PrimeTestTable table;
+    return table;
+  }
+};
+
+/// Arithmetic modulo an odd n in Montgomery form, with R = 2^64.
+struct PrimeTestMontgomery {
+  uint64_t n;
+  /// n^-1 modulo R
+  uint64_t inverse;
+  /// R mod n, the Montgomery form of 1
+  uint64_t one;
+  /// R^2 mod n, to bring numbers into Montgomery form
+  uint64_t r2;
+};
+
+static inline void PrimeTestMontgomeryInit(PrimeTestMontgomery &m, uint64_t n)
+{
+  m.n = n;
+  m.inverse = PrimeTestInverse(n);
+  m.one = (0 - n) % n;
+  m.r2 = (uint64_t)((unsigned __int128)m.one * m.one % n);
+}
+
+/** \brief t / R mod n for t < n*R, in [0, n).
+ *
+ * q = t * n^-1 mod R makes t - q*n a multiple of R, so only the high
+ * words have to be subtracted.
+ */
+static inline uint64_t PrimeTestReduce(const PrimeTestMontgomery &m, unsigned __int128 t)
+{
+  uint64_t high = (uint64_t)(t >> 64);
+  uint64_t q = (uint64_t)t * m.inverse;
+  uint64_t h = (uint64_t)(((unsigned __int128)q * m.n) >> 64);
+  return high >= h ? high - h : high - h + m.n;
+}
+
+/** \brief Product of two numbers in Montgomery form. */
+static inline uint64_t PrimeTestMultiply(const PrimeTestMontgomery &m, uint64_t a, uint64_t b)
+{
+  return PrimeTestReduce(m, (unsigned __int128)a * b);
+}
+
+/** \brief Strong probable prime test of m.n to K bases at once.
+ * \param d odd part of n-1
+ * \param s n-1 = d * 2^s
+ *
+ * All bases are raised to the same power d, so every lane runs the same
+ * squarings and multiplications.  A base that is a multiple of n proves
+ * nothing and is passed.
+ */
+template <int K>
+static inline bool PrimeTestStrong(const PrimeTestMontgomery &m, const uint64_t *bases,
+                                   uint64_t d, int s)
+{
+  uint64_t x[K], base[K];
+  bool passed[K];
+  for (int k = 0; k < K; k++) {
+    uint64_t a = bases[k] % m.n;
+    passed[k] = a == 0;
+    base[k] = PrimeTestMultiply(m, a, m.r2);
+    x[k] = base[k];
+  }
+  /// left to right binary powering, past the leading bit of d
+  for (int bit = 62 - __builtin_clzll(d); bit >= 0; bit--) {
+    for (int k = 0; k < K; k++) x[k] = PrimeTestMultiply(m, x[k], x[k]);
+    if (d >> bit & 1)
+      for (int k = 0; k < K; k++) x[k] = PrimeTestMultiply(m, x[k], base[k]);
+  }
+  const uint64_t minusOne = m.n - m.one;
+  for (int k = 0; k < K; k++)
+    if (x[k] == m.one || x[k] == minusOne) passed[k] = true;
+  for (int r = 1; r < s; r++)
+    for (int k = 0; k < K; k++)
+      if (!passed[k]) {
+        x[k] = PrimeTestMultiply(m, x[k], x[k]);
+        if (x[k] == minusOne) passed[k] = true;
+      }
+  for (int k = 0; k < K; k++)
+    if (!passed[k]) return false;
+  return true;
+}
+
+/** \brief Returns whether n is prime, exactly, for any 64-bit n. */
+static inline bool PrimeTestIsPrime(uint64_t n)
+{
+  if (n < 4) return n >= 2;
+  if (!(n & 1)) return false;
+  const std::vector<PrimeTestDivisor> &divisors = PrimeTestTable::Get().divisors;
+  for (size_t k = 0; k < divisors.size(); k++) {
+    const PrimeTestDivisor &d = divisors[k];
+    if (d.prime * d.prime > n) return true;
+    if (n * d.inverse <= d.limit) return false;
+  }
+  if (n < (uint64_t)PRIME_TEST_TRIAL * PRIME_TEST_TRIAL) return true;
+
+  PrimeTestMontgomery m;
+  PrimeTestMontgomeryInit(m, n);
+  uint64_t d = n - 1;
+  int s = __builtin_ctzll(d);
+  d >>= s;
+  return PrimeTestStrong<1>(m, PRIME_TEST_BASES, d, s)
+      && PrimeTestStrong<6>(m, PRIME_TEST_BASES + 1, d, s);
+}
+
+/** \brief Tests count numbers, spread over the threads of a pool.
+ * \param results receives 1 for every prime and 0 otherwise
+ */
+static inline void PrimeTestBatch(const uint64_t *values, uint8_t *results, uint64_t count,
+                                  ThreadPool &pool)
+{
+  PrimeTestTable::Get();
+  pool.Run([&](int t) {
+    uint64_t low, n;
+    ThreadSlice(count, pool.Size(), t, &low, &n);
+    for (uint64_t i = low; i < low + n; i++) results[i] = PrimeTestIsPrime(values[i]);
+  });
+}
+
+#endif /* PRIME_TEST_H */
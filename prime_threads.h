@@ -0,0 +1,144 @@
+//MIT License
+
+//Copyright (c) 2016 Ashton Johnson
+
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+
+/******************************************************************/
+/**
+* Thread pool for sieving inside one MPI rank
+* @file prime_threads.h
+* @author Ashton Johnson, Paul Henny
+* @brief Fixed pool of worker threads that each own a slice of a block.
+*
+* The MPI drivers run with MPI_THREAD_FUNNELED: only the thread that
+* called MPI_Init_thread talks MPI.  That thread takes part in every
+* ThreadPool::Run as thread 0, so the pool never needs MPI itself.
+*
+* Compile with -pthread.
+*/
+#ifndef PRIME_THREADS_H
+#define PRIME_THREADS_H
+
+#include <stdint.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+
+/// Slices handed to threads start on this byte alignment to keep two
+/// threads off the same cache line.
+#define THREAD_SLICE_ALIGN 64
+
+/** \brief Splits nBytes into threads slices and returns slice t.
+ * \param nBytes size of the whole block
+ * \param threads number of slices
+ * \param t slice wanted
+ * \param low receives the first byte of the slice, relative to the block
+ * \param n receives the length of the slice, possibly 0
+ */
+static inline void ThreadSlice(uint64_t nBytes, int threads, int t,
+                               uint64_t *low, uint64_t *n)
+{
+  uint64_t per = (nBytes / threads + THREAD_SLICE_ALIGN - 1) / THREAD_SLICE_ALIGN
+                 * THREAD_SLICE_ALIGN;
+  uint64_t begin = per * t, end = per * (t + 1);
+  if (begin > nBytes) begin = nBytes;
+  if (end > nBytes || t == threads - 1) end = nBytes;
+  *low = begin;
+  *n = end - begin;
+}
+
+/** \brief Pool of threads that all run the same task on their own index.
+ *
+ * Run(task) calls task(t) once for every t in [0, Size()), with t = 0 on
+ * the calling thread, and returns once all of them have finished.
+ */
+class ThreadPool {
+public:
+  /// Starts threads-1 workers; the caller is the remaining thread.
+  explicit ThreadPool(int threads)
+    : size(threads < 1 ? 1 : threads), generation(0), pending(0), stopping(false)
+  {
+    for (int t = 1; t < size; t++)
+      workers.push_back(std::thread(&ThreadPool::Worker, this, t));
+  }
+
+  ~ThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    start.notify_all();
+    for (size_t t = 0; t < workers.size(); t++) workers[t].join();
+  }
+
+  /// Number of threads, the caller included.
+  int Size() const { return size; }
+
+  /// Runs task(t) on every thread and waits for all of them.
+  void Run(const std::function<void(int)> &job)
+  {
+    if (size == 1) { job(0); return; }
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      task = job;
+      pending = size - 1;
+      generation++;
+    }
+    start.notify_all();
+    job(0);
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [this] { return pending == 0; });
+  }
+
+private:
+  void Worker(int id)
+  {
+    unsigned seen = 0;
+    for (;;) {
+      std::function<void(int)> job;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        start.wait(guard, [&] { return stopping || generation != seen; });
+        if (stopping) return;
+        seen = generation;
+        job = task;
+      }
+      job(id);
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        if (--pending == 0) done.notify_one();
+      }
+    }
+  }
+
+  int size;
+  std::vector<std::thread> workers;
+  std::mutex lock;
+  std::condition_variable start, done;
+  std::function<void(int)> task;
+  unsigned generation;
+  int pending;
+  bool stopping;
+};
+
+#endif /* PRIME_THREADS_H */
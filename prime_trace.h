@@ -0,0 +1,333 @@
+//MIT License
+
+//Copyright (c) 2016 Ashton Johnson
+
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
+
+/******************************************************************/
+/**
+* Per-rank stage timing for the MPI drivers
+* @file prime_trace.h
+* @author Ashton Johnson, Paul Henny
+* @brief Splits each rank's time into init, marking, sending, waiting
+* for messages, gathering results and idling at barriers.
+*
+* Tracing is off unless the PRIME_TRACE environment variable is set on
+* rank 0: "1" prints a table with one row per rank, any other value is
+* the name of a CSV file rank 0 writes the same rows to.  When it is off
+* every hook is a single test of a flag.
+*
+* Each stage also collects CPU cycles and last level cache misses from
+* perf_event_open where the kernel allows it.  The counters follow the
+* thread that calls MPI only, so the marking done by the other threads of
+* the pool shows up in the time of that stage but not in its counters.
+* The last column tells how each rank's sieve array is paged and on which
+* NUMA nodes it lies, as set by PrimeTraceMemory.
+*/
+#ifndef PRIME_TRACE_H
+#define PRIME_TRACE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <vector>
+#include <mpi.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/// Stages a rank's time is split into.
+enum PrimeTraceStage {
+  /// allocating and initializing arrays, finding seed primes locally
+  TRACE_INIT,
+  /// striking primes out of the rank's own block
+  TRACE_MARK,
+  /// posting sends and waiting for them to complete
+  TRACE_SEND,
+  /// waiting for a message to arrive
+  TRACE_RECV,
+  /// bringing counts or primes to rank 0
+  TRACE_GATHER,
+  /// waiting at a barrier for the other ranks
+  TRACE_IDLE,
+  TRACE_STAGES
+};
+
+static const char *const PRIME_TRACE_NAMES[TRACE_STAGES] =
+  { "init", "mark", "send", "recv", "gather", "idle" };
+
+/// Values gathered per rank: the total time, then seconds, cycles and
+/// cache misses of every stage, then messages and bytes sent and received.
+#define PRIME_TRACE_RECORD (1 + 3 * TRACE_STAGES + 4)
+
+/// Room for the placement of a rank's sieve array.
+#define PRIME_TRACE_MEMORY 64
+
+/// Tracing state of this process.
+struct PrimeTrace {
+  /// whether the hooks record anything
+  bool enabled;
+  /// "1" for a table, otherwise the CSV file, only on rank 0
+  const char *target;
+  /// perf_event_open group leader (cycles) and member (cache misses), or -1
+  int cyclesFd, missesFd;
+  /// time and counters when the current stage began
+  struct timespec begin;
+  uint64_t beginCycles, beginMisses;
+  /// time and counters when tracing started and stopped
+  struct timespec start, stop;
+  double seconds[TRACE_STAGES];
+  uint64_t cycles[TRACE_STAGES], misses[TRACE_STAGES];
+  uint64_t sentMessages, sentBytes, receivedMessages, receivedBytes;
+  /// placement of the sieve array, see PrimeMemoryPlacement
+  char memory[PRIME_TRACE_MEMORY];
+
+  PrimeTrace() : enabled(false), target(0), cyclesFd(-1), missesFd(-1) { strcpy(memory, "-"); }
+
+  static PrimeTrace &Get()
+  {
+    static PrimeTrace trace;
+    return trace;
+  }
+};
+
+/** \brief Reads the cycle and cache miss counters, zero without perf. */
+static inline void PrimeTraceCounters(uint64_t *cycles, uint64_t *misses)
+{
+  PrimeTrace &trace = PrimeTrace::Get();
+  *cycles = *misses = 0;
+#ifdef __linux__
+  if (trace.cyclesFd < 0) return;
+  /// PERF_FORMAT_GROUP: the number of events, then one value per event
+  uint64_t values[3] = { 0, 0, 0 };
+  if (read(trace.cyclesFd, values, sizeof(values)) < (ssize_t)(2 * sizeof(uint64_t))) return;
+  *cycles = values[1];
+  if (values[0] > 1) *misses = values[2];
+#endif
+}
+
+/** \brief Opens the hardware counters of the calling thread, if allowed. */
+static inline void PrimeTraceOpenCounters()
+{
+#ifdef __linux__
+  PrimeTrace &trace = PrimeTrace::Get();
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_CPU_CYCLES;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  trace.cyclesFd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  if (trace.cyclesFd < 0) return;
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.disabled = 0;
+  trace.missesFd = syscall(__NR_perf_event_open, &attr, 0, -1, trace.cyclesFd, 0);
+  ioctl(trace.cyclesFd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+/** \brief Switches tracing on in every rank if rank 0 has PRIME_TRACE set.
+ *
+ * Collective over comm; the launcher need not pass the environment on to
+ * the other ranks.  Call it right after MPI is initialized.
+ */
+static inline void PrimeTraceInit(MPI_Comm comm)
+{
+  PrimeTrace &trace = PrimeTrace::Get();
+  int rank, on = 0;
+  MPI_Comm_rank(comm, &rank);
+  if (rank == 0) {
+    trace.target = getenv("PRIME_TRACE");
+    on = trace.target && *trace.target && strcmp(trace.target, "0") != 0;
+  }
+  MPI_Bcast(&on, 1, MPI_INT, 0, comm);
+  trace.enabled = on;
+  if (!trace.enabled) return;
+  for (int s = 0; s < TRACE_STAGES; s++) {
+    trace.seconds[s] = 0;
+    trace.cycles[s] = trace.misses[s] = 0;
+  }
+  trace.sentMessages = trace.sentBytes = trace.receivedMessages = trace.receivedBytes = 0;
+  PrimeTraceOpenCounters();
+  clock_gettime(CLOCK_MONOTONIC, &trace.start);
+  trace.stop = trace.start;
+}
+
+/** \brief Marks the start of a stage; stages do not nest. */
+static inline void PrimeTraceBegin()
+{
+  PrimeTrace &trace = PrimeTrace::Get();
+  if (!trace.enabled) return;
+  PrimeTraceCounters(&trace.beginCycles, &trace.beginMisses);
+  clock_gettime(CLOCK_MONOTONIC, &trace.begin);
+}
+
+/** \brief Charges the time since PrimeTraceBegin to stage. */
+static inline void PrimeTraceEnd(PrimeTraceStage stage)
+{
+  PrimeTrace &trace = PrimeTrace::Get();
+  if (!trace.enabled) return;
+  struct timespec end;
+  uint64_t cycles, misses;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  PrimeTraceCounters(&cycles, &misses);
+  trace.seconds[stage] += (end.tv_sec - trace.begin.tv_sec) + (end.tv_nsec - trace.begin.tv_nsec) / 1e9;
+  trace.cycles[stage] += cycles - trace.beginCycles;
+  trace.misses[stage] += misses - trace.beginMisses;
+}
+
+/** \brief Counts a message of bytes bytes sent by this rank. */
+static inline void PrimeTraceSent(uint64_t bytes)
+{
+  PrimeTrace &trace = PrimeTrace::Get();
+  if (!trace.enabled) return;
+  trace.sentMessages++;
+  trace.sentBytes += bytes;
+}
+
+/** \brief Counts a message of bytes bytes received by this rank. */
+static inline void PrimeTraceReceived(uint64_t bytes)
+{
+  PrimeTrace &trace = PrimeTrace::Get();
+  if (!trace.enabled) return;
+  trace.receivedMessages++;
+  trace.receivedBytes += bytes;
+}
+
+/** \brief Records where the sieve array of this rank lies.
+ * \param fill called as fill(text, size) to write the placement; it is
+ * only called when tracing is on
+ */
+template <typename Fill>
+static inline void PrimeTraceMemory(Fill fill)
+{
+  PrimeTrace &trace = PrimeTrace::Get();
+  if (trace.enabled) fill(trace.memory, (size_t)PRIME_TRACE_MEMORY);
+}
+
+/** \brief Ends the traced run; whatever follows is not in the total. */
+static inline void PrimeTraceStop()
+{
+  PrimeTrace &trace = PrimeTrace::Get();
+  if (trace.enabled) clock_gettime(CLOCK_MONOTONIC, &trace.stop);
+}
+
+/** \brief Gathers every rank's record on rank 0 and prints or writes it.
+ *
+ * Collective over comm.  The time from PrimeTraceInit to PrimeTraceStop
+ * not charged to any stage is reported as "other".
+ */
+static inline void PrimeTraceReport(MPI_Comm comm)
+{
+  PrimeTrace &trace = PrimeTrace::Get();
+  if (!trace.enabled) return;
+  int rank, size;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &size);
+
+  double record[PRIME_TRACE_RECORD];
+  int v = 0;
+  record[v++] = (trace.stop.tv_sec - trace.start.tv_sec) + (trace.stop.tv_nsec - trace.start.tv_nsec) / 1e9;
+  for (int s = 0; s < TRACE_STAGES; s++) {
+    record[v++] = trace.seconds[s];
+    record[v++] = (double)trace.cycles[s];
+    record[v++] = (double)trace.misses[s];
+  }
+  record[v++] = (double)trace.sentMessages;
+  record[v++] = (double)trace.sentBytes;
+  record[v++] = (double)trace.receivedMessages;
+  record[v++] = (double)trace.receivedBytes;
+
+  std::vector<double> all(rank == 0 ? (size_t)size * PRIME_TRACE_RECORD : 1);
+  MPI_Gather(record, PRIME_TRACE_RECORD, MPI_DOUBLE, &all[0], PRIME_TRACE_RECORD, MPI_DOUBLE, 0, comm);
+  std::vector<char> memory(rank == 0 ? (size_t)size * PRIME_TRACE_MEMORY : 1);
+  MPI_Gather(trace.memory, PRIME_TRACE_MEMORY, MPI_CHAR, &memory[0], PRIME_TRACE_MEMORY, MPI_CHAR,
+             0, comm);
+  if (rank != 0) return;
+
+  bool table = strcmp(trace.target, "1") == 0;
+  std::ofstream file;
+  if (!table) {
+    file.open(trace.target);
+    if (!file) {
+      std::cout << "Error: cannot write trace to " << trace.target << std::endl;
+      return;
+    }
+  }
+  std::ostream &out = table ? std::cout : file;
+  if (table) {
+    out << std::fixed << std::setprecision(6);
+    out << std::setw(5) << "rank" << std::setw(11) << "total";
+    for (int s = 0; s < TRACE_STAGES; s++) out << std::setw(11) << PRIME_TRACE_NAMES[s];
+    out << std::setw(11) << "other" << std::setw(9) << "sent" << std::setw(13) << "bytes"
+        << std::setw(9) << "received" << std::setw(13) << "bytes"
+        << std::setw(15) << "cycles" << std::setw(13) << "llc_misses" << "  memory\n";
+  } else {
+    out << std::setprecision(9);
+    out << "rank,total";
+    for (int s = 0; s < TRACE_STAGES; s++)
+      out << "," << PRIME_TRACE_NAMES[s] << "," << PRIME_TRACE_NAMES[s] << "_cycles,"
+          << PRIME_TRACE_NAMES[s] << "_llc_misses";
+    out << ",other,sent_messages,sent_bytes,received_messages,received_bytes,memory\n";
+  }
+  for (int r = 0; r < size; r++) {
+    const double *row = &all[(size_t)r * PRIME_TRACE_RECORD];
+    double other = row[0], cycles = 0, misses = 0;
+    for (int s = 0; s < TRACE_STAGES; s++) {
+      other -= row[1 + 3 * s];
+      cycles += row[2 + 3 * s];
+      misses += row[3 + 3 * s];
+    }
+    const double *counts = row + 1 + 3 * TRACE_STAGES;
+    const char *placement = &memory[(size_t)r * PRIME_TRACE_MEMORY];
+    if (table) {
+      out << std::setw(5) << r << std::setw(11) << row[0];
+      for (int s = 0; s < TRACE_STAGES; s++) out << std::setw(11) << row[1 + 3 * s];
+      out << std::setw(11) << other;
+      out << std::setw(9) << (uint64_t)counts[0] << std::setw(13) << (uint64_t)counts[1]
+          << std::setw(9) << (uint64_t)counts[2] << std::setw(13) << (uint64_t)counts[3];
+      if (cycles == 0 && misses == 0)
+        out << std::setw(15) << "-" << std::setw(13) << "-";
+      else
+        out << std::setw(15) << (uint64_t)cycles << std::setw(13) << (uint64_t)misses;
+      out << "  " << placement << "\n";
+    } else {
+      out << r << "," << row[0];
+      for (int s = 0; s < TRACE_STAGES; s++)
+        out << "," << row[1 + 3 * s] << "," << (uint64_t)row[2 + 3 * s] << ","
+            << (uint64_t)row[3 + 3 * s];
+      out << "," << other;
+      for (int c = 0; c < 4; c++) out << "," << (uint64_t)counts[c];
+      out << "," << placement << "\n";
+    }
+  }
+  out << std::flush;
+}
+
+#endif /* PRIME_TRACE_H */
@@ -3,7 +3,7 @@ clear
 
 FILENAME=prime_chain
 module load openmpi
-mpic++ ./$FILENAME.cpp -o $FILENAME.o 
+mpic++ ./$FILENAME.cpp -o $FILENAME.o -pthread
 
 for NUM in 100 1000 10000 100000 1000000 10000000 100000000 1000000000
 do
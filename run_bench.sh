@@ -0,0 +1,144 @@
+#! /bin/sh
+# Benchmark sweep over every engine, N, rank count and thread count.
+#
+# Every configuration is run SAMPLES times.  The programs time themselves
+# on the monotonic clock and print one "<stage>=<seconds> seconds" line per
+# stage; the median of each stage is kept.  The prime count of every run
+# is checked against pi(N) whenever N is a power of ten.
+#
+# Settings come from the environment:
+#   ENGINES  engines to run (default: all of serial segmented fanout local
+#            chain pipelined)
+#   NS       numbers to sieve up to
+#   RANKS    MPI rank counts, for the MPI engines
+#   THREADS  threads per rank, for the MPI engines
+#   SAMPLES  runs per configuration
+#   WEAK     1 to grow N with ranks*threads (weak scaling); otherwise N is
+#            kept fixed (strong scaling)
+#   MPIRUN   MPI launcher, for example "srun" or "mpirun --oversubscribe"
+#   OUT      prefix of the result files, OUT.csv and OUT.json
+#
+# Efficiency is T(1)/(p*T(p)) for strong scaling and T(1)/T(p) for weak
+# scaling, where p is ranks*threads and T(1) is the same engine with one
+# rank and one thread on the same N (strong) or the same N per worker
+# (weak).  Throughput is numbers sieved per second of the "time" stage.
+
+ENGINES=${ENGINES:-"serial segmented fanout local chain pipelined"}
+NS=${NS:-"1000000 10000000 100000000 1000000000"}
+RANKS=${RANKS:-"1 2 4"}
+THREADS=${THREADS:-"1 2"}
+SAMPLES=${SAMPLES:-3}
+WEAK=${WEAK:-0}
+MPIRUN=${MPIRUN:-mpirun}
+OUT=${OUT:-bench}
+
+command -v module >/dev/null 2>&1 && module load openmpi
+
+mkdir -p bench_bin
+g++ ./prime.cpp -o bench_bin/prime -O3 -lm -pthread || exit 1
+mpic++ ./prime_mpi.cpp -o bench_bin/prime_mpi -O3 -lm -pthread || exit 1
+mpic++ ./prime_chain.cpp -o bench_bin/prime_chain -O3 -lm -pthread || exit 1
+
+# number of primes below N, for the powers of ten
+known_pi() {
+  case $1 in
+    10) echo 4 ;;
+    100) echo 25 ;;
+    1000) echo 168 ;;
+    10000) echo 1229 ;;
+    100000) echo 9592 ;;
+    1000000) echo 78498 ;;
+    10000000) echo 664579 ;;
+    100000000) echo 5761455 ;;
+    1000000000) echo 50847534 ;;
+    10000000000) echo 455052511 ;;
+    100000000000) echo 4118054813 ;;
+    1000000000000) echo 37607912018 ;;
+    *) echo "" ;;
+  esac
+}
+
+# command line of one run
+engine_command() {
+  engine=$1; n=$2; ranks=$3; threads=$4
+  case $engine in
+    serial) echo "bench_bin/prime --count $n" ;;
+    segmented) echo "bench_bin/prime -s --count $n" ;;
+    fanout) echo "$MPIRUN -np $ranks bench_bin/prime_mpi --threads $threads --count $n" ;;
+    local) echo "$MPIRUN -np $ranks bench_bin/prime_mpi --mode local --threads $threads --count $n" ;;
+    chain) echo "$MPIRUN -np $ranks bench_bin/prime_chain -t $threads --count $n" ;;
+    pipelined) echo "$MPIRUN -np $ranks bench_bin/prime_chain -p -t $threads --count $n" ;;
+  esac
+}
+
+ROWS=$(mktemp)
+STAGES=$(mktemp)
+trap 'rm -f "$ROWS" "$STAGES"' EXIT
+
+for engine in $ENGINES; do
+  case $engine in
+    serial|segmented) ranklist=1; threadlist=1 ;;
+    *) ranklist=$RANKS; threadlist=$THREADS ;;
+  esac
+  for base in $NS; do
+    for ranks in $ranklist; do
+      for threads in $threadlist; do
+        workers=$((ranks*threads))
+        n=$base
+        [ "$WEAK" = 1 ] && n=$((base*workers))
+        cmd=$(engine_command $engine $n $ranks $threads)
+        : > "$STAGES"
+        primes=""
+        sample=1
+        while [ $sample -le "$SAMPLES" ]; do
+          out=$($cmd 2>&1)
+          primes=$(echo "$out" | sed -n 's/^primes=\([0-9]*\).*/\1/p' | head -1)
+          echo "$out" | sed -n 's/^\([a-z_]*\)=\([0-9.eE+-]*\) seconds$/\1 \2/p' >> "$STAGES"
+          sample=$((sample+1))
+        done
+        expected=$(known_pi $n)
+        ok=unchecked
+        [ -n "$expected" ] && { [ "$primes" = "$expected" ] && ok=pass || ok=FAIL; }
+        # per-stage medians as stage:seconds;stage:seconds
+        stages=$(sort -k1,1 -k2,2g "$STAGES" | awk '
+          { v[$1, ++c[$1]] = $2; if (!($1 in seen)) { seen[$1] = 1; order[++k] = $1 } }
+          END { for (i = 1; i <= k; i++) { s = order[i]; m = int((c[s] + 1) / 2)
+                  printf "%s%s:%s", (i > 1 ? ";" : ""), s, v[s, m] } }')
+        echo "$engine,$n,$base,$ranks,$threads,$SAMPLES,$primes,$expected,$ok,$stages" >> "$ROWS"
+        echo "$engine N=$n ranks=$ranks threads=$threads primes=$primes ($ok) $stages"
+      done
+    done
+  done
+done
+
+# add throughput and scaling efficiency, then write CSV and JSON
+awk -F, -v weak="$WEAK" -v csv="$OUT.csv" -v json="$OUT.json" '
+  function stage(list, name,   parts, kv, i) {
+    split(list, parts, ";")
+    for (i in parts) { split(parts[i], kv, ":"); if (kv[1] == name) return kv[2] }
+    return ""
+  }
+  { row[NR] = $0; t = stage($10, "time"); time[NR] = t
+    if ($4 * $5 == 1) one[$1, (weak == 1 ? $3 : $2)] = t }
+  END {
+    print "engine,n,ranks,threads,samples,primes,expected,check,time,throughput,efficiency,stages" > csv
+    printf "[\n" > json
+    for (i = 1; i <= NR; i++) {
+      split(row[i], f, ","); t = time[i]; p = f[4] * f[5]
+      tput = (t > 0) ? sprintf("%.6g", f[2] / t) : ""
+      key = f[1] SUBSEP (weak == 1 ? f[3] : f[2]); eff = ""
+      if ((key in one) && t > 0) eff = sprintf("%.4f", weak == 1 ? one[key] / t : one[key] / (p * t))
+      print f[1] "," f[2] "," f[4] "," f[5] "," f[6] "," f[7] "," f[8] "," f[9] "," t "," tput "," eff "," f[10] > csv
+      n = split(f[10], parts, ";"); st = ""
+      for (j = 1; j <= n; j++) { split(parts[j], kv, ":"); st = st (j > 1 ? ", " : "") "\"" kv[1] "\": " kv[2] }
+      printf "  {\"engine\": \"%s\", \"n\": %s, \"ranks\": %s, \"threads\": %s, \"samples\": %s, ", f[1], f[2], f[4], f[5], f[6] > json
+      printf "\"primes\": %s, \"expected\": %s, \"check\": \"%s\", ", (f[7] == "" ? "null" : f[7]), (f[8] == "" ? "null" : f[8]), f[9] > json
+      printf "\"time\": %s, \"throughput\": %s, \"efficiency\": %s, \"stages\": {%s}}%s\n", (t == "" ? "null" : t), (tput == "" ? "null" : tput), (eff == "" ? "null" : eff), st, (i < NR ? "," : "") > json
+    }
+    printf "]\n" > json
+  }' "$ROWS"
+
+printf "\n\n================================================\n\n"
+echo "results in $OUT.csv and $OUT.json"
+grep -q ',FAIL,' "$OUT.csv" && { echo "some prime counts did not match pi(N)"; exit 1; }
+exit 0